@@ -19,10 +19,18 @@
 /* libvmon integration, warning: this gets a little crazy especially in the rendering. */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
 
 #ifdef USE_XLIB
 #include <X11/extensions/Xfixes.h>
@@ -43,12 +51,13 @@
 #define CHART_ISTHREAD_ARGV		"~"				/* use this string to mark threads in the argv field */
 #define CHART_NOCOMM_ARGV		"# missed it!"			/* use this string to substitute the command when missing in argv field */
 #define CHART_MAX_ARGC			64				/* this is a huge amount */
-#define CHART_VMON_PROC_WANTS		(VMON_WANT_PROC_STAT | VMON_WANT_PROC_FOLLOW_CHILDREN | VMON_WANT_PROC_FOLLOW_THREADS)
+#define CHART_VMON_PROC_WANTS		(VMON_WANT_PROC_STAT | VMON_WANT_PROC_FOLLOW_CHILDREN | VMON_WANT_PROC_FOLLOW_THREADS | VMON_WANT_PROC_EXIT)
 #define CHART_VMON_SYS_WANTS		(VMON_WANT_SYS_STAT)
 #define CHART_MAX_COLUMNS		16
 #define CHART_DELTA_SECONDS_EPSILON	.001f				/* adherence errors smaller than this are treated as zero */
 #define CHART_NUM_FIXED_HEADER_ROWS	3				/* number of rows @ top before the hierarchy: { IOWait/Idle, IRQ/SoftIRQ, Adherence } */
 #define CHART_DEFAULT_INTERVAL_SECS	.1f				/* default to 10Hz */
+#define CHART_ACCT_HEADER		"pid,tgid,ppid,comm,start,end,utime,stime,peak_rss_kb,rchar,wchar,read_bytes,write_bytes,exit_code,argv\n"
 
 /* the global charts state, supplied to vwm_chart_create() which keeps a reference for future use. */
 typedef struct _vwm_charts_t {
@@ -69,6 +78,15 @@ typedef struct _vwm_charts_t {
 	unsigned				marker_distance;
 	float					inv_ticks_per_sec, inv_total_delta;
 	unsigned				defer_maintenance:1;
+	unsigned				perf:1;		/* VMON_WANT_PROC_PERF is sampled, VWM_CHARTS_FLAG_PERF */
+	unsigned				schedstat:1;	/* VMON_WANT_PROC_SCHEDSTAT is sampled, VWM_CHARTS_FLAG_SCHEDSTAT */
+
+	/* accounting log, see vwm_charts_accounting_open() */
+	struct {
+		int				fd;		/* -1 when not accounting */
+		char				*buf;		/* records awaiting vwm_charts_accounting_flush() */
+		size_t				len, size;
+	} acct;
 } vwm_charts_t;
 
 typedef enum _vwm_column_type_t {
@@ -82,6 +100,9 @@ typedef enum _vwm_column_type_t {
 	VWM_COLUMN_PROC_PID,
 	VWM_COLUMN_PROC_WCHAN,
 	VWM_COLUMN_PROC_STATE,
+	VWM_COLUMN_PROC_CSW,
+	VWM_COLUMN_PROC_MIGR,
+	VWM_COLUMN_PROC_RUNQ,
 	VWM_COLUMN_CNT
 } vwm_column_type_t;
 
@@ -131,10 +152,20 @@ typedef struct _vwm_chart_t {
 /* space we need for every process being monitored */
 typedef struct _vwm_perproc_ctxt_t {
 	typeof(((vmon_t *)0)->generation)	generation;
+	typeof(((vmon_proc_t *)0)->sampled_generation)	sampled_generation;
 	typeof(((vmon_proc_stat_t *)0)->utime)	last_utime;
 	typeof(((vmon_proc_stat_t *)0)->stime)	last_stime;
 	typeof(((vmon_proc_stat_t *)0)->utime)	utime_delta;
 	typeof(((vmon_proc_stat_t *)0)->stime)	stime_delta;
+	typeof(((vmon_proc_stat_t *)0)->utime)	drawn_utime;		/* sums of the deltas drawn, checked against the totals sampled */
+	typeof(((vmon_proc_stat_t *)0)->stime)	drawn_stime;
+	typeof(((vmon_proc_perf_t *)0)->context_switches)	last_csw;
+	typeof(((vmon_proc_perf_t *)0)->cpu_migrations)		last_migr;
+	float					csw_rate, migr_rate;	/* per second, over the last sampling */
+	typeof(((vmon_proc_schedstat_t *)0)->run_delay_ns)	last_run_delay;
+	float					runq_ratio;		/* fraction of the last sampling spent waiting on a runqueue */
+	struct timespec				sampled_at;		/* this_sample of the last sampling, rates are over the time measured since */
+	unsigned				rates_changed:1;
 	int					row;
 } vwm_perproc_ctxt_t;
 
@@ -148,6 +179,28 @@ static float	sampling_intervals[] = {
 		};
 
 
+/* convenience function for returning the time delta as a seconds.fraction float */
+static float delta(struct timespec *cur, struct timespec *prev)
+{
+	struct timespec	res;
+	float		delta;
+
+	/* determine the # of whole.fractional seconds between prev and cur */
+	/* this is basically open-coded timersub() to operate on timespec */
+	res.tv_sec = cur->tv_sec - prev->tv_sec;
+	res.tv_nsec = cur->tv_nsec - prev->tv_nsec;
+	if (res.tv_nsec < 0 ) {
+		res.tv_sec--;
+		res.tv_nsec += 1000000000;
+	}
+
+	delta = res.tv_sec;
+	delta += (float)((float)res.tv_nsec) * .000000001f;
+
+	return delta;
+}
+
+
 /* wrapper around snprintf always returning the length of what's in the buf */
 static int snpf(char *str, size_t size, const char *format, ...)
 {
@@ -199,6 +252,37 @@ static void vmon_dtor_cb(vmon_t *vmon, vmon_proc_t *proc)
 }
 
 
+/* see if the perf_event counters VMON_WANT_PROC_PERF opens are permitted, by opening one on ourselves */
+static int perf_permitted(void)
+{
+	struct perf_event_attr	attr = {
+					.size = sizeof(attr),
+					.type = PERF_TYPE_SOFTWARE,
+					.config = PERF_COUNT_SW_CONTEXT_SWITCHES,
+					.exclude_hv = 1,
+				};
+	int			fd;
+
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd == -1)
+		return 0;
+
+	close(fd);
+
+	return 1;
+}
+
+
+/* the perf_event counters of proc, a main thread's are its process's (see vmon_proc_perf_t) */
+static vmon_proc_perf_t * perf_store(const vmon_proc_t *proc)
+{
+	if (proc->is_thread && proc->parent && proc->pid == proc->parent->pid)
+		proc = proc->parent;
+
+	return proc->stores[VMON_STORE_PROC_PERF];
+}
+
+
 /* initialize charts system */
 vwm_charts_t * vwm_charts_create(vcr_backend_t *vbe, unsigned flags)
 {
@@ -211,13 +295,27 @@ vwm_charts_t * vwm_charts_create(vcr_backend_t *vbe, unsigned flags)
 	}
 
 	charts->vcr_backend = vbe;
+	charts->acct.fd = -1;
 
 	if (flags & VWM_CHARTS_FLAG_DEFER_MAINTENANCE)
 		charts->defer_maintenance = 1;
 
+	if (flags & VWM_CHARTS_FLAG_PERF) {
+		/* rather than charting empty columns, the counters need perf_event_paranoid <= 1 or CAP_PERFMON */
+		if (!perf_permitted()) {
+			VWM_PERROR("unable to open perf_event counters (see /proc/sys/kernel/perf_event_paranoid)");
+			goto _err_charts;
+		}
+
+		charts->perf = 1;
+	}
+
+	if (flags & VWM_CHARTS_FLAG_SCHEDSTAT)
+		charts->schedstat = 1;
+
 	charts->prev_sampling_interval_secs = charts->sampling_interval_secs = CHART_DEFAULT_INTERVAL_SECS;
 
-	if (!vmon_init(&charts->vmon, VMON_FLAG_2PASS, CHART_VMON_SYS_WANTS, CHART_VMON_PROC_WANTS)) {
+	if (!vmon_init(&charts->vmon, VMON_FLAG_2PASS | VMON_FLAG_PROC_EVENTS | VMON_FLAG_PIDFD | ((flags & VWM_CHARTS_FLAG_ADAPTIVE) ? VMON_FLAG_ADAPTIVE : 0), CHART_VMON_SYS_WANTS, CHART_VMON_PROC_WANTS | (charts->perf ? VMON_WANT_PROC_PERF : 0) | (charts->schedstat ? VMON_WANT_PROC_SCHEDSTAT : 0))) {
 		VWM_ERROR("unable to initialize libvmon");
 		goto _err_charts;
 	}
@@ -244,11 +342,212 @@ _err:
 /* teardown charts system */
 void vwm_charts_destroy(vwm_charts_t *charts)
 {
+	if (charts->acct.fd != -1) {
+		vwm_charts_accounting_flush(charts);
+		close(charts->acct.fd);
+	}
+	free(charts->acct.buf);
+
 	/* TODO: free rest of stuff.. */
 	free(charts);
 }
 
 
+/* make room for at least need more bytes in the accounting buffer, returns 0 on failure */
+static int acct_reserve(vwm_charts_t *charts, size_t need)
+{
+	size_t	size = charts->acct.size ? charts->acct.size : 4096;
+	char	*buf;
+
+	if (charts->acct.len + need <= charts->acct.size)
+		return 1;
+
+	while (charts->acct.len + need > size)
+		size *= 2;
+
+	buf = realloc(charts->acct.buf, size);
+	if (!buf) {
+		VWM_PERROR("unable to grow accounting buffer");
+		return 0;
+	}
+
+	charts->acct.buf = buf;
+	charts->acct.size = size;
+
+	return 1;
+}
+
+
+/* append formatted text to the accounting buffer */
+static void acct_printf(vwm_charts_t *charts, const char *fmt, ...)
+{
+	va_list	ap;
+	int	n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (n < 0 || !acct_reserve(charts, n + 1))
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(charts->acct.buf + charts->acct.len, n + 1, fmt, ap);
+	va_end(ap);
+
+	charts->acct.len += n;
+}
+
+
+/* append len bytes of str to the accounting buffer escaped for use within a quoted CSV field */
+static void acct_quote(vwm_charts_t *charts, const char *str, size_t len)
+{
+	if (!acct_reserve(charts, len * 2))
+		return;
+
+	for (size_t i = 0; i < len && str[i]; i++) {
+		if (str[i] == '"')
+			charts->acct.buf[charts->acct.len++] = '"';
+		charts->acct.buf[charts->acct.len++] = str[i];
+	}
+}
+
+
+/* append a CSV record of proc's totals to the accounting buffer, called when proc is found stale.
+ * Exited processes have their final totals in the exit store, others (like a monitored root going
+ * away with the chart) get whatever was last sampled, with the fields only the exit store has left empty.
+ */
+static void account_proc(vwm_charts_t *charts, vmon_proc_t *proc)
+{
+	vmon_proc_stat_t	*proc_stat = proc->stores[VMON_STORE_PROC_STAT];
+	vmon_proc_exit_t	*proc_exit = proc->stores[VMON_STORE_PROC_EXIT];
+	vmon_proc_io_t		*proc_io = proc->stores[VMON_STORE_PROC_IO];
+	struct timespec		realtime, boottime;
+	double			booted, start, end, utime, stime;
+
+	if (charts->acct.fd == -1 || !proc_stat)
+		return;
+
+	if (proc_exit && !proc_exit->exited)
+		proc_exit = NULL;
+
+	/* start is in ticks since boot, realtime less boottime is when that was */
+	clock_gettime(CLOCK_REALTIME, &realtime);
+	clock_gettime(CLOCK_BOOTTIME, &boottime);
+	booted = (double)(realtime.tv_sec - boottime.tv_sec) + (double)(realtime.tv_nsec - boottime.tv_nsec) * 1e-9;
+	start = booted + (double)proc_stat->start / (double)charts->vmon.ticks_per_sec;
+
+	utime = (double)proc_stat->utime / (double)charts->vmon.ticks_per_sec;
+	stime = (double)proc_stat->stime / (double)charts->vmon.ticks_per_sec;
+	if (proc_exit) {
+		end = start + (double)proc_exit->etime_us * 1e-6;
+
+		/* the exit sums miss tasks which exited unseen (see draw_exit_bars()), never report less than already sampled */
+		if ((double)proc_exit->utime_us * 1e-6 > utime)
+			utime = (double)proc_exit->utime_us * 1e-6;
+		if ((double)proc_exit->stime_us * 1e-6 > stime)
+			stime = (double)proc_exit->stime_us * 1e-6;
+	} else {
+		end = (double)realtime.tv_sec + (double)realtime.tv_nsec * 1e-9;
+	}
+
+	acct_printf(charts, "%i,%i,%lli,\"", proc->pid, proc->is_thread ? proc->parent->pid : proc->pid, proc_stat->ppid);
+	if (proc_stat->comm.len)
+		acct_quote(charts, proc_stat->comm.array, proc_stat->comm.len - 1);
+	acct_printf(charts, "\",%.2f,%.2f,%.6f,%.6f,", start, end, utime, stime);
+
+	if (proc_exit)
+		acct_printf(charts, "%llu,%llu,%llu,%llu,%llu,%u,",
+			proc_exit->hiwater_rss,
+			proc_exit->rchars,
+			proc_exit->wchars,
+			proc_exit->read_bytes,
+			proc_exit->write_bytes,
+			proc_exit->exit_code);
+	else if (proc_io)
+		acct_printf(charts, ",%llu,%llu,%llu,%llu,,",
+			proc_io->rchars,
+			proc_io->wchars,
+			proc_io->read_bytes,
+			proc_io->write_bytes);
+	else
+		acct_printf(charts, ",,,,,,");
+
+	acct_printf(charts, "\"");
+	for (int i = 0; i < proc_stat->argc; i++) {
+		if (i)
+			acct_printf(charts, " ");
+		acct_quote(charts, proc_stat->argv[i], strlen(proc_stat->argv[i]));
+	}
+	acct_printf(charts, "\"\n");
+}
+
+
+/* start appending a CSV record per process (and thread) leaving the charts to path, records are buffered
+ * until vwm_charts_accounting_flush(), which callers should do outside of their sampling (or at least
+ * before they sleep).  Returns 0 on success, -errno on failure.
+ */
+int vwm_charts_accounting_open(vwm_charts_t *charts, const char *path)
+{
+	struct stat	st;
+	int		fd;
+
+	assert(charts);
+	assert(path);
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return -errno;
+
+	if (fstat(fd, &st) == -1) {
+		int	err = errno;
+
+		close(fd);
+		return -err;
+	}
+
+	if (charts->acct.fd != -1) {
+		vwm_charts_accounting_flush(charts);
+		close(charts->acct.fd);
+	}
+	charts->acct.fd = fd;
+
+	if (!st.st_size)
+		acct_printf(charts, CHART_ACCT_HEADER);
+
+	return 0;
+}
+
+
+/* write out any buffered accounting records */
+void vwm_charts_accounting_flush(vwm_charts_t *charts)
+{
+	size_t	off = 0;
+
+	assert(charts);
+
+	if (charts->acct.fd == -1)
+		return;
+
+	while (off < charts->acct.len) {
+		ssize_t	ret;
+
+		ret = write(charts->acct.fd, charts->acct.buf + off, charts->acct.len - off);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			VWM_PERROR("unable to write accounting records, dropping %zu bytes", charts->acct.len - off);
+			break;
+		}
+
+		off += ret;
+	}
+
+	charts->acct.len = 0;
+}
+
+
 /* moves what's below a given row up above it, preserve the lost row's graphs @ hierarchy end */
 static void snowflake_row(vwm_charts_t *charts, vwm_chart_t *chart, int row)
 {
@@ -395,6 +694,35 @@ static void mark_finish(vwm_charts_t *charts, vwm_chart_t *chart, int row)
 }
 
 
+/* helper for drawing the final interval of an exited process at the current phase, from its totals at exit */
+static void draw_exit_bars(vwm_charts_t *charts, vwm_chart_t *chart, vmon_proc_t *proc, int row)
+{
+	vmon_proc_exit_t	*proc_exit = proc->stores[VMON_STORE_PROC_EXIT];
+	vwm_perproc_ctxt_t	*proc_ctxt = proc->foo;
+	float			utime_delta, stime_delta;
+
+	/* there's no interval to finish without the totals or an earlier sampling to measure it from */
+	if (!proc_exit || !proc_exit->exited || !proc_ctxt->sampled_generation)
+		return;
+
+	/* like a sampling after a backoff, everything since the last sampling is drawn in full here (see draw_chart_rest()),
+	 * the totals may come up short for processes which had threads exit before libvmon was listening, never go negative */
+	utime_delta = (float)proc_exit->utime_us * 1e-6f * (float)charts->vmon.ticks_per_sec - (float)proc_ctxt->last_utime;
+	stime_delta = (float)proc_exit->stime_us * 1e-6f * (float)charts->vmon.ticks_per_sec - (float)proc_ctxt->last_stime;
+	if (utime_delta < 0.f)
+		utime_delta = 0.f;
+	if (stime_delta < 0.f)
+		stime_delta = 0.f;
+
+	draw_bars(charts, chart, row,
+		(proc->is_thread || !proc->is_threaded) ? charts->vmon.num_cpus : 1.f /* mult */,
+		stime_delta,
+		charts->inv_total_delta,
+		utime_delta,
+		charts->inv_total_delta);
+}
+
+
 /* helper for drawing a proc's argv @ specified x offset and row on the chart */
 static void print_argv(const vwm_charts_t *charts, const vwm_chart_t *chart, int x, int row, const vmon_proc_t *proc, int *res_width)
 {
@@ -570,6 +898,8 @@ static void draw_columns(vwm_charts_t *charts, vwm_chart_t *chart, vwm_column_t
 {
 	vmon_sys_stat_t		*sys_stat = charts->vmon.stores[VMON_STORE_SYS_STAT];
 	vmon_proc_stat_t	*proc_stat = proc->stores[VMON_STORE_PROC_STAT];
+	vmon_proc_perf_t	*proc_perf = perf_store(proc);
+	vmon_proc_schedstat_t	*proc_schedstat = proc->stores[VMON_STORE_PROC_SCHEDSTAT];
 	vwm_perproc_ctxt_t	*proc_ctxt = proc->foo;
 	char			str[256];
 
@@ -719,6 +1049,46 @@ static void draw_columns(vwm_charts_t *charts, vwm_chart_t *chart, vwm_column_t
 			str_justify = VWM_JUSTIFY_CENTER;
 			break;
 
+		case VWM_COLUMN_PROC_CSW: /* print the task's context switch rate */
+			if (heading)
+				str_len = snpf(str, sizeof(str), "CSw/s");
+			else {
+				/* the counters are per-task, processes with threads have theirs shown by the main thread */
+				if ((!proc->is_thread && !list_empty(&proc->threads)) || !proc_perf || proc_perf->fds[VMON_PROC_PERF_CONTEXT_SWITCHES] == -1)
+					break;
+
+				str_len = snpf(str, sizeof(str), "%.0f", proc_ctxt->csw_rate);
+			}
+
+			str_justify = VWM_JUSTIFY_RIGHT;
+			break;
+
+		case VWM_COLUMN_PROC_MIGR: /* print the task's cpu migration rate */
+			if (heading)
+				str_len = snpf(str, sizeof(str), "Migr/s");
+			else {
+				if ((!proc->is_thread && !list_empty(&proc->threads)) || !proc_perf || proc_perf->fds[VMON_PROC_PERF_CPU_MIGRATIONS] == -1)
+					break;
+
+				str_len = snpf(str, sizeof(str), "%.0f", proc_ctxt->migr_rate);
+			}
+
+			str_justify = VWM_JUSTIFY_RIGHT;
+			break;
+
+		case VWM_COLUMN_PROC_RUNQ: /* print the task's share of time spent waiting to run */
+			if (heading)
+				str_len = snpf(str, sizeof(str), "RunQ");
+			else {
+				if ((!proc->is_thread && !list_empty(&proc->threads)) || !proc_schedstat)
+					break;
+
+				str_len = snpf(str, sizeof(str), "%.0f%%", proc_ctxt->runq_ratio * 100.f);
+			}
+
+			str_justify = VWM_JUSTIFY_RIGHT;
+			break;
+
 		default:
 			assert(0);
 		}
@@ -828,6 +1198,12 @@ static int columns_changed(const vwm_charts_t *charts, const vwm_chart_t *chart,
 			if (BITTEST(proc_stat->changed, VMON_PROC_STAT_STATE))
 				return 1;
 			break;
+		case VWM_COLUMN_PROC_CSW:
+		case VWM_COLUMN_PROC_MIGR:
+		case VWM_COLUMN_PROC_RUNQ:
+			if (proc_ctxt->rates_changed)
+				return 1;
+			break;
 		default:
 			assert(0);
 		}
@@ -860,6 +1236,8 @@ static void draw_overlay_row(vwm_charts_t *charts, vwm_chart_t *chart, vmon_proc
 static void draw_chart_rest(vwm_charts_t *charts, vwm_chart_t *chart, vmon_proc_t *proc, int *depth, int *row, int deferred_pass, unsigned sample_duration_idx)
 {
 	vmon_proc_stat_t	*proc_stat = proc->stores[VMON_STORE_PROC_STAT];
+	vmon_proc_perf_t	*proc_perf = perf_store(proc);
+	vmon_proc_schedstat_t	*proc_schedstat = proc->stores[VMON_STORE_PROC_SCHEDSTAT];
 	vwm_perproc_ctxt_t	*proc_ctxt = proc->foo;
 	vmon_proc_t		*child;
 	float			utime_delta, stime_delta;
@@ -924,6 +1302,8 @@ static void draw_chart_rest(vwm_charts_t *charts, vwm_chart_t *chart, vmon_proc_
 					(*depth), (*row), proc->is_thread);
 
 				mark_finish(charts, chart, (*row));
+				draw_exit_bars(charts, chart, proc, (*row)); /* over the finish line */
+				account_proc(charts, proc);
 
 				/* extract the row from the various layers */
 				snowflake_row(charts, chart, (*row));
@@ -951,10 +1331,56 @@ static void draw_chart_rest(vwm_charts_t *charts, vwm_chart_t *chart, vmon_proc_
 
 			/* use the generation number to avoid recomputing this stuff for callbacks recurring on the same process in the same sample */
 			if (proc_ctxt->generation != charts->vmon.generation) {
-				proc_ctxt->stime_delta = proc_stat->stime - proc_ctxt->last_stime;
-				proc_ctxt->utime_delta = proc_stat->utime - proc_ctxt->last_utime;
-				proc_ctxt->last_utime = proc_stat->utime;
-				proc_ctxt->last_stime = proc_stat->stime;
+				proc_ctxt->rates_changed = 0;
+
+				/* with VMON_FLAG_ADAPTIVE idle processes aren't sampled every generation, there's nothing to draw for them until
+				 * they are, then whatever accumulated since their previous sampling is drawn in full so the backoff loses no time. */
+				if (proc->sampled_generation == charts->vmon.generation) {
+					float		elapsed = 0.f;
+
+					/* sampling falls behind and changes rate, so the elapsed time is measured rather than assumed from the generations */
+					if (proc_ctxt->sampled_generation)
+						elapsed = delta(&charts->this_sample, &proc_ctxt->sampled_at);
+
+					proc_ctxt->stime_delta = proc_stat->stime - proc_ctxt->last_stime;
+					proc_ctxt->utime_delta = proc_stat->utime - proc_ctxt->last_utime;
+					proc_ctxt->last_stime = proc_stat->stime;
+					proc_ctxt->last_utime = proc_stat->utime;
+					proc_ctxt->drawn_stime += proc_ctxt->stime_delta;
+					proc_ctxt->drawn_utime += proc_ctxt->utime_delta;
+					assert(proc_ctxt->drawn_stime == proc_stat->stime && proc_ctxt->drawn_utime == proc_stat->utime);
+
+					if (proc_perf) {
+						float	csw_rate = 0.f, migr_rate = 0.f;
+
+						if (elapsed > 0.f) {
+							csw_rate = (float)(proc_perf->context_switches - proc_ctxt->last_csw) / elapsed;
+							migr_rate = (float)(proc_perf->cpu_migrations - proc_ctxt->last_migr) / elapsed;
+						}
+
+						proc_ctxt->rates_changed |= (csw_rate != proc_ctxt->csw_rate || migr_rate != proc_ctxt->migr_rate);
+						proc_ctxt->csw_rate = csw_rate;
+						proc_ctxt->migr_rate = migr_rate;
+						proc_ctxt->last_csw = proc_perf->context_switches;
+						proc_ctxt->last_migr = proc_perf->cpu_migrations;
+					}
+
+					if (proc_schedstat) {
+						float	runq_ratio = 0.f;
+
+						if (elapsed > 0.f)
+							runq_ratio = (float)(proc_schedstat->run_delay_ns - proc_ctxt->last_run_delay) * 1e-9f / elapsed;
+
+						proc_ctxt->rates_changed |= (runq_ratio != proc_ctxt->runq_ratio);
+						proc_ctxt->runq_ratio = runq_ratio;
+						proc_ctxt->last_run_delay = proc_schedstat->run_delay_ns;
+					}
+
+					proc_ctxt->sampled_generation = proc->sampled_generation;
+					proc_ctxt->sampled_at = charts->this_sample;
+				} else {
+					proc_ctxt->stime_delta = proc_ctxt->utime_delta = 0;
+				}
 
 				proc_ctxt->generation = charts->vmon.generation;
 			}
@@ -1210,6 +1636,9 @@ vwm_chart_t * vwm_chart_create(vwm_charts_t *charts, int pid, int width, int hei
 	chart->columns[6] = (vwm_column_t){ .enabled = 1, .type = VWM_COLUMN_PROC_STATE, .side = VWM_SIDE_RIGHT };
 	chart->columns[7] = (vwm_column_t){ .enabled = 1, .type = VWM_COLUMN_PROC_PID, .side = VWM_SIDE_RIGHT };
 	chart->columns[8] = (vwm_column_t){ .enabled = 1, .type = VWM_COLUMN_PROC_WCHAN, .side = VWM_SIDE_RIGHT };
+	chart->columns[9] = (vwm_column_t){ .enabled = charts->schedstat, .type = VWM_COLUMN_PROC_RUNQ, .side = VWM_SIDE_RIGHT };
+	chart->columns[10] = (vwm_column_t){ .enabled = charts->perf, .type = VWM_COLUMN_PROC_MIGR, .side = VWM_SIDE_RIGHT };
+	chart->columns[11] = (vwm_column_t){ .enabled = charts->perf, .type = VWM_COLUMN_PROC_CSW, .side = VWM_SIDE_RIGHT };
 
 	chart->snowflake_columns[0] = (vwm_column_t){ .enabled = 1, .type = VWM_COLUMN_PROC_PID, .side = VWM_SIDE_LEFT };
 	chart->snowflake_columns[1] = (vwm_column_t){ .enabled = 1, .type = VWM_COLUMN_PROC_USER, .side = VWM_SIDE_LEFT };
@@ -1253,6 +1682,9 @@ _err:
 /* stop monitoring and destroy the supplied chart */
 void vwm_chart_destroy(vwm_charts_t *charts, vwm_chart_t *chart)
 {
+	/* the root isn't followed by anything which would find it stale, record it on the way out */
+	if (!chart->proc->is_stale)
+		account_proc(charts, chart->proc);
 	vmon_proc_unmonitor(&charts->vmon, chart->proc, (void (*)(vmon_t *, void *, vmon_proc_t *, void *))proc_sample_callback, chart);
 	vcr_free(chart->vcr);
 	free(chart->name);
@@ -1378,28 +1810,6 @@ void vwm_charts_marker_distance_set(vwm_charts_t *charts, unsigned distance)
 }
 
 
-/* convenience function for returning the time delta as a seconds.fraction float */
-static float delta(struct timespec *cur, struct timespec *prev)
-{
-	struct timespec	res;
-	float		delta;
-
-	/* determine the # of whole.fractional seconds between prev and cur */
-	/* this is basically open-coded timersub() to operate on timespec */
-	res.tv_sec = cur->tv_sec - prev->tv_sec;
-	res.tv_nsec = cur->tv_nsec - prev->tv_nsec;
-	if (res.tv_nsec < 0 ) {
-		res.tv_sec--;
-		res.tv_nsec += 1000000000;
-	}
-
-	delta = res.tv_sec;
-	delta += (float)((float)res.tv_nsec) * .000000001f;
-
-	return delta;
-}
-
-
 static inline int delta_close_enough(vwm_charts_t *charts, float delta)
 {
 	float	remainder = charts->sampling_interval_secs - delta;
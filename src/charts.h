@@ -11,6 +11,9 @@
 #include "vcr.h"
 
 #define VWM_CHARTS_FLAG_DEFER_MAINTENANCE 0x1
+#define VWM_CHARTS_FLAG_ADAPTIVE 0x2
+#define VWM_CHARTS_FLAG_PERF 0x4
+#define VWM_CHARTS_FLAG_SCHEDSTAT 0x8
 
 typedef struct _vwm_charts_t vwm_charts_t;
 typedef struct _vwm_chart_t vwm_chart_t;
@@ -22,6 +25,8 @@ void vwm_charts_rate_decrease(vwm_charts_t *charts);
 void vwm_charts_rate_set(vwm_charts_t *charts, unsigned hertz);
 void vwm_charts_marker_distance_set(vwm_charts_t *charts, unsigned distance);
 int vwm_charts_update(vwm_charts_t *charts, int *desired_delay_us);
+int vwm_charts_accounting_open(vwm_charts_t *charts, const char *path);
+void vwm_charts_accounting_flush(vwm_charts_t *charts);
 void charts_vmon_dump_procs(vwm_charts_t *charts, FILE *out);
 
 vwm_chart_t * vwm_chart_create(vwm_charts_t *charts, int pid, int width, int height, const char *name);
@@ -0,0 +1,123 @@
+/*
+ *  libvmon - a lightweight linux system/process monitoring library,
+ *  intended for linking directly into gpl programs.
+ *
+ *  Copyright (c) 2012-2017  Vito Caputo - <vcaputo@pengaru.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmark of char_array_set(), the compare-and-update every sampled string (comm, cmdline, wchan...) goes through,
+ * formerly memcmpcpy().  First a mismatch at every offset of every length below CHECK_LEN_MAX is checked to leave the array
+ * holding exactly the new contents with the changed bit set iff they differed, then the common unchanged case is timed.
+ *
+ * usage: bench_char_array [iterations scale]
+ */
+
+#include "vmon.c"
+
+#include <time.h>
+
+#define CHECK_LEN_MAX	200
+#define BENCH_RUNS	7
+
+static const size_t	bench_lens[] = { 16, 64, 256, 1024, 4096, 32768 };
+
+
+static double now_ns(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* set a to n bytes of 'x' differing from b only at offset k (none when k == n), returns -1 on a wrong result */
+static int check(vmon_t *vmon, vmon_char_array_t *a, size_t n, size_t k)
+{
+	char	x[CHECK_LEN_MAX], y[CHECK_LEN_MAX], changed = 0;
+
+	memset(x, 'x', n);
+	memcpy(y, x, n);
+	if (k < n)
+		y[k] = 'y';
+
+	if (char_array_set(vmon, a, x, n, &changed, 0) < 0)
+		return -1;
+
+	changed = 0;
+	if (char_array_set(vmon, a, y, n, &changed, 0) < 0)
+		return -1;
+
+	if (a->len != n || memcmp(a->array, y, n) || !!changed != (k < n))
+		return -1;
+
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	vmon_t			vmon;
+	vmon_char_array_t	a = {};
+	long			scale = argc > 1 ? atol(argv[1]) : 200000000;
+	static char		src[32768];
+
+	if (!vmon_init(&vmon, VMON_FLAG_NONE, VMON_WANT_SYS_NONE, 0))
+		return EXIT_FAILURE;
+
+	for (size_t n = 0; n < CHECK_LEN_MAX; n++) {
+		for (size_t k = 0; k <= n; k++) {
+			if (check(&vmon, &a, n, k) < 0) {
+				fprintf(stderr, "mismatch at %zu of %zu handled wrong\n", k, n);
+
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	printf("mismatch offsets < %i ok\n", CHECK_LEN_MAX);
+
+	for (size_t i = 0; i < sizeof(src); i++)
+		src[i] = "abcdefgh /-"[i % 11];
+
+	for (size_t l = 0; l < sizeof(bench_lens) / sizeof(*bench_lens); l++) {
+		size_t	n = bench_lens[l];
+		long	iters = scale / (n + 64);
+		double	best = 1e18;
+		char	changed;
+
+		char_array_set(&vmon, &a, src, n, &changed, 0);
+		for (int r = 0; r < BENCH_RUNS; r++) {
+			double	t = now_ns();
+
+			for (long i = 0; i < iters; i++) {
+				changed = 0;
+				char_array_set(&vmon, &a, src, n, &changed, 0);
+				__asm__ volatile("" : : "r"(a.array) : "memory");
+			}
+
+			t = (now_ns() - t) / iters;
+			if (t < best)
+				best = t;
+		}
+
+		printf("n=%5zu unchanged: %8.1f ns\n", n, best);
+	}
+
+	char_array_release(&vmon, &a);
+	vmon_destroy(&vmon);
+
+	return EXIT_SUCCESS;
+}
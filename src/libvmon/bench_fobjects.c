@@ -0,0 +1,128 @@
+/*
+ *  libvmon - a lightweight linux system/process monitoring library,
+ *  intended for linking directly into gpl programs.
+ *
+ *  Copyright (c) 2012-2017  Vito Caputo - <vcaputo@pengaru.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of VMON_WANT_PROC_FILES against an fd-heavy process, a child holding the requested numbers of pipes and unix
+ * socket pairs open, exercising the per-type fobject hash tables.  The first sample readlinks and looks up every fd, the
+ * following ones are timed.  Unmonitoring the child must leave no fobjects behind.
+ *
+ * usage: bench_fobjects [pipes [socketpairs [samples]]]
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmon.h"
+
+static double now_ms(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int		n_pipes = argc > 1 ? atoi(argv[1]) : 8000;
+	int		n_socks = argc > 2 ? atoi(argv[2]) : 500;
+	int		n_samples = argc > 3 ? atoi(argv[3]) : 32;
+	struct rlimit	rlim;
+	int		sync[2], fds[2], ret = EXIT_FAILURE;
+	vmon_t		vmon;
+	vmon_proc_t	*proc;
+	pid_t		pid;
+	double		t;
+	char		c;
+
+	/* the child needs two fds per pipe and socketpair */
+	if (!getrlimit(RLIMIT_NOFILE, &rlim)) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	if (pipe(sync) == -1)
+		return EXIT_FAILURE;
+
+	pid = fork();
+	if (pid == -1)
+		return EXIT_FAILURE;
+
+	if (!pid) {
+		for (int i = 0; i < n_pipes; i++) {
+			if (pipe(fds) == -1)
+				_exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < n_socks; i++) {
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+				_exit(EXIT_FAILURE);
+		}
+
+		(void) !write(sync[1], "", 1);
+		pause();
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(sync[1]);
+	if (read(sync[0], &c, 1) != 1) {
+		fprintf(stderr, "child failed to open its fds, see RLIMIT_NOFILE\n");
+		goto _out;
+	}
+
+	if (!vmon_init(&vmon, VMON_FLAG_NONE, VMON_WANT_SYS_NONE, VMON_WANT_PROC_FILES))
+		goto _out;
+
+	proc = vmon_proc_monitor(&vmon, pid, VMON_WANT_PROC_FILES, NULL, NULL);
+	if (!proc)
+		goto _out_vmon;
+
+	t = now_ms();
+	vmon_sample(&vmon);
+	printf("%i pipes %i socketpairs: %i fobjects, first sample %.2fms", n_pipes, n_socks, vmon.fobjects_nr, now_ms() - t);
+
+	t = now_ms();
+	for (int i = 0; i < n_samples; i++)
+		vmon_sample(&vmon);
+	printf(", then %.2fms/sample\n", (now_ms() - t) / n_samples);
+
+	vmon_proc_unmonitor(&vmon, proc, NULL, NULL);
+	vmon_sample(&vmon);
+	if (vmon.fobjects_nr) {
+		fprintf(stderr, "%i fobjects left after unmonitoring\n", vmon.fobjects_nr);
+		goto _out_vmon;
+	}
+
+	ret = EXIT_SUCCESS;
+
+_out_vmon:
+	vmon_destroy(&vmon);
+_out:
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+	return ret;
+}
@@ -0,0 +1,229 @@
+/*
+ *  libvmon - a lightweight linux system/process monitoring library,
+ *  intended for linking directly into gpl programs.
+ *
+ *  Copyright (c) 2012-2017  Vito Caputo - <vcaputo@pengaru.com>
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmark of the children and threads reconciliation on a wide fan-out, this process with the requested numbers of child
+ * processes and threads.  Every iteration replaces the requested number of randomly chosen children and threads with new ones,
+ * then times proc_follow_children() and proc_follow_threads() on this process.  Finally the hierarchy must hold exactly the
+ * live children and threads.
+ *
+ * usage: bench_follow [children [threads [iterations [churn]]]]
+ */
+
+#include "vmon.c"
+
+#include <semaphore.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <time.h>
+
+typedef struct _bench_thread_t {
+	pthread_t	thread;
+	sem_t		exit;		/* the thread exits once this is posted, unlike a pipe the forked children can't hold it up */
+} bench_thread_t;
+
+
+static double now_us(void)
+{
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e6 + ts.tv_nsec * 1e-3;
+}
+
+
+static pid_t child_spawn(void)
+{
+	pid_t	pid = fork();
+
+	if (!pid) {
+		pause();
+		_exit(EXIT_SUCCESS);
+	}
+
+	return pid;
+}
+
+
+static void child_reap(pid_t pid)
+{
+	if (pid <= 0)
+		return;
+
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+
+static void * thread_func(void *arg)
+{
+	bench_thread_t	*t = arg;
+
+	while (sem_wait(&t->exit) == -1);
+
+	return NULL;
+}
+
+
+static int thread_spawn(bench_thread_t *t)
+{
+	if (sem_init(&t->exit, 0, 0) == -1)
+		return -1;
+
+	if (pthread_create(&t->thread, NULL, thread_func, t)) {
+		sem_destroy(&t->exit);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+
+static void thread_reap(bench_thread_t *t)
+{
+	sem_post(&t->exit);
+	pthread_join(t->thread, NULL);
+	sem_destroy(&t->exit);
+}
+
+
+/* count the live entries of the children or threads list at head */
+static int count_live(list_head_t *head, int threads)
+{
+	vmon_proc_t	*proc;
+	int		n = 0;
+
+	if (threads) {
+		list_for_each_entry(proc, head, threads)
+			n += !proc->is_stale;
+	} else {
+		list_for_each_entry(proc, head, siblings)
+			n += !proc->is_stale;
+	}
+
+	return n;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int		n_children = argc > 1 ? atoi(argv[1]) : 2000;
+	int		n_threads = argc > 2 ? atoi(argv[2]) : 1000;
+	int		n_iters = argc > 3 ? atoi(argv[3]) : 40;
+	int		churn = argc > 4 ? atoi(argv[4]) : 20;
+	pid_t		*children = calloc(n_children, sizeof(pid_t));
+	bench_thread_t	*threads = calloc(n_threads, sizeof(bench_thread_t));
+	double		children_us = 0, threads_us = 0;
+	int		ret = EXIT_FAILURE, live_children, live_threads, expected_threads;
+	vmon_t		vmon;
+	vmon_proc_t	*self;
+
+	if (!children || !threads)
+		return EXIT_FAILURE;
+
+	for (int i = 0; i < n_children; i++) {
+		if ((children[i] = child_spawn()) == -1) {
+			fprintf(stderr, "fork failed at %i children\n", i);
+			n_children = i;
+			break;
+		}
+	}
+
+	for (int i = 0; i < n_threads; i++) {
+		if (thread_spawn(&threads[i]) == -1) {
+			fprintf(stderr, "thread creation failed at %i threads\n", i);
+			n_threads = i;
+			break;
+		}
+	}
+
+	if (!vmon_init(&vmon, VMON_FLAG_NONE, VMON_WANT_SYS_NONE, VMON_WANT_PROC_STAT | VMON_WANT_PROC_FOLLOW_CHILDREN | VMON_WANT_PROC_FOLLOW_THREADS))
+		goto _out;
+
+	self = vmon_proc_monitor(&vmon, getpid(), VMON_WANT_PROC_INHERIT, NULL, NULL);
+	if (!self)
+		goto _out_vmon;
+
+	/* the samplers are called directly so only the reconciliation gets timed, the stat sampler supplies num_threads */
+	for (int i = 0; i <= n_iters; i++) {
+		double	t;
+
+		for (int j = 0; i && j < churn; j++) {
+			if (n_children) {
+				int	c = rand() % n_children;
+
+				child_reap(children[c]);
+				children[c] = child_spawn();
+			}
+
+			if (n_threads) {
+				bench_thread_t	*thread = &threads[rand() % n_threads];
+
+				thread_reap(thread);
+				if (thread_spawn(thread) == -1) {
+					*thread = threads[--n_threads];
+					goto _out_vmon;
+				}
+			}
+		}
+
+		vmon.generation++;
+		proc_sample_stat(&vmon, self, (vmon_proc_stat_t **)&self->stores[VMON_STORE_PROC_STAT]);
+
+		t = now_us();
+		proc_follow_children(&vmon, self, (vmon_proc_follow_children_t **)&self->stores[VMON_STORE_PROC_FOLLOW_CHILDREN]);
+		if (i)
+			children_us += now_us() - t;
+
+		t = now_us();
+		proc_follow_threads(&vmon, self, (vmon_proc_follow_threads_t **)&self->stores[VMON_STORE_PROC_FOLLOW_THREADS]);
+		if (i)
+			threads_us += now_us() - t;
+	}
+
+	live_children = count_live(&self->children, 0);
+	live_threads = count_live(&self->threads, 1);
+	expected_threads = n_threads ? n_threads + 1 : 0; /* a single-threaded process has no threads followed */
+	printf("%i children %i threads, %i churned per iteration: children %.1fus, threads %.1fus\n",
+		n_children, n_threads, churn, children_us / n_iters, threads_us / n_iters);
+
+	if (live_children != n_children || live_threads != expected_threads) {
+		fprintf(stderr, "followed %i children and %i threads, expected %i and %i\n", live_children, live_threads, n_children, expected_threads);
+		goto _out_unmonitor;
+	}
+
+	ret = EXIT_SUCCESS;
+
+_out_unmonitor:
+	vmon_proc_unmonitor(&vmon, self, NULL, NULL);
+_out_vmon:
+	vmon_destroy(&vmon);
+_out:
+	for (int i = 0; i < n_children; i++)
+		child_reap(children[i]);
+
+	for (int i = 0; i < n_threads; i++)
+		thread_reap(&threads[i]);
+
+	free(children);
+	free(threads);
+
+	return ret;
+}
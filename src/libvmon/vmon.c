@@ -25,19 +25,43 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
 #include <inttypes.h>
 #include <dirent.h>
 #include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include <linux/genetlink.h>
+#include <linux/taskstats.h>
+#include <linux/acct.h>
+#include <linux/perf_event.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+#include <sys/syscall.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 #include "list.h"
 
 #include "vmon.h"
 
 #define VMON_INTERNAL_PROC_IS_THREAD	(1L << 31)	/* used to communicate to vmon_proc_monitor() that the pid is a tid */
+#define IDLE_WANTS			(VMON_WANT_PROC_STAT | VMON_WANT_PROC_VM | VMON_WANT_PROC_IO | VMON_WANT_PROC_PERF | VMON_WANT_PROC_SCHEDSTAT)	/* VMON_FLAG_ADAPTIVE backs off sampling these wants for idle processes */
+#define READ_SLACK			256				/* see READ_COUNT() */
+#define READ_COUNT(_size)		((_size) + ((_size) >> 2) + READ_SLACK)	/* read size for a file whose contents were last _size bytes, leaving room to grow without a retry */
 
 /* valid return values for the sampler functions, these are private to the library */
 typedef enum _sample_ret_t {
@@ -65,10 +89,10 @@ static void try_close(int *fd)
 {
 	assert(fd);
 
-	if ((*fd) != -1) {
+	if ((*fd) >= 0)
 		close((*fd));
-		(*fd) = -1;
-	}
+
+	(*fd) = -1;
 }
 
 
@@ -87,388 +111,2609 @@ static ssize_t try_pread(int fd, void *buf, size_t count, off_t offset)
 {
 	assert(buf);
 
-	if (fd != -1) {
+	if (fd >= 0) {
 		return pread(fd, buf, count, offset);
 	} else {
 		errno = EBADF;
-		return fd;
+		return -1;
 	}
 }
 
 
-/* this does a copy from src to dest
- * sets the bit specified by changed_pos in the bitmap *changed if what was copied to src was different from what was already there */
-static void memcmpcpy(void *dest, const void *src, size_t n, char *changed, unsigned changed_pos)
+/* the children files only get read when neither the ppid scan nor the proc connector are keeping the children current */
+static inline int read_children_files(vmon_t *vmon)
 {
-	size_t	i = 0;
+	return !vmon->ppids && (vmon->proc_events_fd == -1 || vmon->proc_events_rescan);
+}
 
-	assert(dest);
-	assert(src);
-	assert(changed);
 
-	/* if the changed bit is set on entry we don't execute the comparison-copy */
-	if (!BITTEST(changed, changed_pos)) {
-		/* a simple slow compare and copy loop, break out if we've found a change */
-		/* XXX TODO: an obvious optimization would be to compare and copy words at a time... */
-		for (; i < n; i++) {
-			if (((char *)dest)[i] != ((char *)src)[i]) {
-				BITSET(changed, changed_pos);
-				break;
-			}
+#ifdef HAVE_LINUX_IO_URING_H
+/* io_uring batched reading of the per-sample /proc files, see VMON_FLAG_IO_URING.
+ * At the start of every sample all the files the samplers are about to read get queued as reads into an arena, submitted in
+ * ring-sized batches, then the samplers' sample_pread() calls are served from the completions.  Anything not prefetched, or
+ * which didn't fit in its prefetch, is read with pread() like before.
+ */
+#define URING_ENTRIES	256
+
+typedef struct _prefetch_t {
+	unsigned		generation;		/* sample the read was issued in, entries from other samples are ignored */
+	int			res;			/* completion result, bytes read or -errno */
+	size_t			size;			/* size of the read, res == size means the contents may be truncated */
+	size_t			offset;			/* offset of the data in the arena */
+} prefetch_t;
+
+struct _vmon_uring_t {
+	int			fd;
+	void			*sq_ring, *cq_ring;
+	size_t			sq_ring_len, cq_ring_len, sqes_len;
+	unsigned		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	unsigned		sq_entries;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+
+	prefetch_t		*prefetch;		/* prefetched reads indexed by fd */
+	int			prefetch_alloc_nr;
+	int			*queued;		/* fds queued for reading this sample */
+	int			queued_nr, queued_alloc_nr;
+	char			*arena;			/* destination buffer for all the reads */
+	size_t			arena_used, arena_alloc_len;
+};
+
+
+static void uring_close(struct _vmon_uring_t *uring)
+{
+	if (!uring)
+		return;
 
-			((char *)dest)[i] = ((char *)src)[i];
-		}
-	}
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_len);
 
-	/* memcpy whatever remains */
-	if (n - i)
-		memcpy(&((char *)dest)[i], &((char *)src)[i], n - i);
-}
+	if (uring->cq_ring && uring->cq_ring != uring->sq_ring)
+		munmap(uring->cq_ring, uring->cq_ring_len);
 
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_len);
 
-typedef enum _vmon_load_flags_t {
-	LOAD_FLAGS_NONE		= 0,
-	LOAD_FLAGS_NOTRUNCATE	= 1L
-} vmon_load_flags_t;
+	try_close(&uring->fd);
+	try_free((void **)&uring->prefetch);
+	try_free((void **)&uring->queued);
+	try_free((void **)&uring->arena);
+	free(uring);
+}
 
-/* we enlarge *alloc if necessary, but never shrink it.  changed[changed_pos] bit is set if a difference is detected, supply LOAD_FLAGS_NOTRUNCATE if we don't want empty contents to truncate last-known data */
-static int load_contents_fd(vmon_t *vmon, vmon_char_array_t *array, int fd, vmon_load_flags_t flags, char *changed, unsigned changed_pos)
+
+/* setup an io_uring instance, returns NULL when io_uring is unavailable or not permitted */
+static struct _vmon_uring_t * uring_open(void)
 {
-	size_t	total = 0;
-	ssize_t	len;
+	struct io_uring_params	params = {};
+	struct _vmon_uring_t	*uring;
 
-	assert(vmon);
-	assert(array);
-	assert(changed);
+	uring = calloc(1, sizeof(struct _vmon_uring_t));
+	if (!uring)
+		return NULL;
 
-	if (fd < 0) /* no use attempting the pread() on -1 fds */
-		return 0;
+	uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (uring->fd == -1)
+		goto _err;
 
-	/* FIXME: this is used to read proc files, you can't actually read proc files iteratively
-	 * without race conditions; it needs to be all done as a single read.
-	 */
-	while ((len = pread(fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		size_t	newsize = total + len;
+	uring->sq_entries = params.sq_entries;
+	uring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
 
-		if (newsize > array->alloc_len) {
-			char	*tmp;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP)) {
+		if (uring->cq_ring_len > uring->sq_ring_len)
+			uring->sq_ring_len = uring->cq_ring_len;
+		uring->cq_ring_len = uring->sq_ring_len;
+	}
 
-			tmp = realloc(array->array, newsize);
-			if (!tmp)
-				return -ENOMEM;
+	uring->sq_ring = mmap(NULL, uring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		goto _err;
+	}
 
-			array->array = tmp;
-			array->alloc_len = newsize;
+	if ((params.features & IORING_FEAT_SINGLE_MMAP)) {
+		uring->cq_ring = uring->sq_ring;
+	} else {
+		uring->cq_ring = mmap(NULL, uring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+		if (uring->cq_ring == MAP_FAILED) {
+			uring->cq_ring = NULL;
+			goto _err;
 		}
+	}
 
-		memcmpcpy(&array->array[total], vmon->buf, len, changed, changed_pos);
-
-		total += len;
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto _err;
 	}
 
-	/* if we read something or didn't encounter an error, store the new total */
-	if (total || (len == 0 && !(flags & LOAD_FLAGS_NOTRUNCATE))) {
-		/* if the new length differs ensure the changed bit is set */
-		if (array->len != total)
-			BITSET(changed, changed_pos);
+	uring->sq_head = uring->sq_ring + params.sq_off.head;
+	uring->sq_tail = uring->sq_ring + params.sq_off.tail;
+	uring->sq_mask = uring->sq_ring + params.sq_off.ring_mask;
+	uring->sq_array = uring->sq_ring + params.sq_off.array;
+	uring->cq_head = uring->cq_ring + params.cq_off.head;
+	uring->cq_tail = uring->cq_ring + params.cq_off.tail;
+	uring->cq_mask = uring->cq_ring + params.cq_off.ring_mask;
+	uring->cqes = uring->cq_ring + params.cq_off.cqes;
 
-		array->len = total;
-	}
+	return uring;
 
-	return 0;
+_err:
+	uring_close(uring);
+
+	return NULL;
 }
 
 
-/* convenience function for opening a path using a format string, path is temporarily assembled in vmon->buf */
-static int openf(vmon_t *vmon, int flags, DIR *dir, char *fmt, ...)
+/* queue a read of size bytes from the start of fd for this sample */
+static void uring_queue(vmon_t *vmon, int fd, size_t size)
 {
-	int	fd;
-	va_list	va_arg;
-	char	buf[4096];
+	struct _vmon_uring_t	*uring = vmon->uring;
+	prefetch_t		*prefetch;
 
-	assert(vmon);
-	assert(dir);
-	assert(fmt);
+	if (fd < 0)
+		return;
 
-	va_start(va_arg, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, va_arg); /* XXX accepting the possibility of truncating the path */
-	va_end(va_arg);
+	if (fd >= uring->prefetch_alloc_nr) {
+		int	nr = (fd + 1) * 2;
 
-	fd = openat(dirfd(dir), buf, flags);
+		prefetch = realloc(uring->prefetch, nr * sizeof(prefetch_t));
+		if (!prefetch)
+			return;
 
-	return fd;
+		memset(&prefetch[uring->prefetch_alloc_nr], 0, (nr - uring->prefetch_alloc_nr) * sizeof(prefetch_t));
+		uring->prefetch = prefetch;
+		uring->prefetch_alloc_nr = nr;
+	}
+
+	if (uring->queued_nr >= uring->queued_alloc_nr) {
+		int	nr = uring->queued_alloc_nr ? uring->queued_alloc_nr * 2 : URING_ENTRIES;
+		int	*queued;
+
+		queued = realloc(uring->queued, nr * sizeof(int));
+		if (!queued)
+			return;
+
+		uring->queued = queued;
+		uring->queued_alloc_nr = nr;
+	}
+
+	prefetch = &uring->prefetch[fd];
+	prefetch->generation = vmon->generation;
+	prefetch->res = -EAGAIN;
+	prefetch->size = size;
+	prefetch->offset = uring->arena_used;
+
+	uring->arena_used += size;
+	uring->queued[uring->queued_nr++] = fd;
 }
 
 
-/* convenience function for opening a directory using a format string, path is temporarily assembled in vmon->buf */
-static DIR * opendirf(vmon_t *vmon, DIR *dir, char *fmt, ...)
+/* collect the results of the completed reads into their prefetches, returns how many completed */
+static int uring_reap(struct _vmon_uring_t *uring)
 {
-	int	fd;
-	va_list	va_arg;
-	char	buf[4096];
-
-	assert(vmon);
-	assert(dir);
-	assert(fmt);
+	unsigned	head = *uring->cq_head;
+	int		reaped = 0;
 
-	va_start(va_arg, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, va_arg); /* XXX accepting the possibility of truncating the path */
-	va_end(va_arg);
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe	*cqe = &uring->cqes[head & *uring->cq_mask];
 
-	fd = openat(dirfd(dir), buf, O_RDONLY);
-	if (fd == -1)
-		return NULL;
+		uring->prefetch[cqe->user_data].res = cqe->res;
+		head++;
+		reaped++;
+	}
+	__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
 
-	return fdopendir(fd);
+	return reaped;
 }
 
 
-/* enlarge an array by the specified amount */
-static int grow_array(vmon_char_array_t *array, size_t amount)
+/* submit all the queued reads and wait for their completion, returns -1 if the ring has become unusable */
+static int uring_submit(vmon_t *vmon)
 {
-	char	*tmp;
+	struct _vmon_uring_t	*uring = vmon->uring;
+	int			submitted = 0;
 
-	assert(array);
+	if (uring->arena_used > uring->arena_alloc_len) {
+		char	*arena;
 
-	tmp = realloc(array->array, array->alloc_len + amount);
-	if (!tmp)
-		return -ENOMEM;
+		arena = realloc(uring->arena, uring->arena_used);
+		if (!arena)
+			return 0; /* nothing gets served from the prefetch, the samplers just pread() */
 
-	array->alloc_len += amount;
-	array->array = tmp;
+		uring->arena = arena;
+		uring->arena_alloc_len = uring->arena_used;
+	}
+
+	while (submitted < uring->queued_nr) {
+		unsigned	tail = *uring->sq_tail;
+		int		n, sent = 0, reaped = 0;
+
+		for (n = 0; n < uring->sq_entries && submitted + n < uring->queued_nr; n++) {
+			unsigned		idx = (tail + n) & *uring->sq_mask;
+			struct io_uring_sqe	*sqe = &uring->sqes[idx];
+			int			fd = uring->queued[submitted + n];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = (uintptr_t)&uring->arena[uring->prefetch[fd].offset];
+			sqe->len = uring->prefetch[fd].size;
+			sqe->user_data = fd;
+			uring->sq_array[idx] = idx;
+		}
+		__atomic_store_n(uring->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+		/* The kernel may stop short of submitting all of them, in which case it doesn't wait for completions either,
+		 * the rest are left in the ring for the next enter.  So only completions of what was submitted get waited on.
+		 */
+		while (reaped < n) {
+			int	ret;
+
+			ret = syscall(__NR_io_uring_enter, uring->fd, n - sent, n - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret == -1 && errno == EINTR)
+				continue;
+
+			if (ret == -1 || (ret == 0 && sent < n && reaped == sent)) {
+				/* the ring is no use, but the reads in flight target the arena, let them land before it can be freed */
+				while (reaped < sent) {
+					if (syscall(__NR_io_uring_enter, uring->fd, 0, sent - reaped, IORING_ENTER_GETEVENTS, NULL, 0) == -1 && errno != EINTR)
+						break;
+
+					reaped += uring_reap(uring);
+				}
+
+				return -1;
+			}
+
+			sent += ret;
+			reaped += uring_reap(uring);
+		}
+
+		submitted += n;
+	}
 
 	return 0;
 }
 
 
-/* load the contents of a symlink, dir is not optional */
-#define READLINKF_GROWINIT	10
-#define READLINKF_GROWBY	2
-static int readlinkf(vmon_t *vmon, vmon_char_array_t *array, DIR *dir, char *fmt, ...)
+/* prefetch everything the samplers are going to read this sample */
+static void uring_prefetch(vmon_t *vmon)
 {
-	char	buf[4096];
-	va_list	va_arg;
-	ssize_t	len;
+	struct _vmon_uring_t	*uring = vmon->uring;
+	vmon_sys_stat_t		*sys_stat = vmon->stores[VMON_STORE_SYS_STAT];
+	vmon_sys_vm_t		*sys_vm = vmon->stores[VMON_STORE_SYS_VM];
+	vmon_proc_t		*proc;
+	int			i;
 
-	assert(vmon);
-	assert(array);
-	assert(dir);
-	assert(fmt);
+	/* the reads are sized from the contents lengths learned by read_contents() so they generally complete in one go */
+	uring->arena_used = 0;
+	uring->queued_nr = 0;
 
-	va_start(va_arg, fmt);
-	vsnprintf(buf, sizeof(buf), fmt, va_arg);
-	va_end(va_arg);
+	if ((vmon->sys_wants & VMON_WANT_SYS_STAT) && sys_stat)
+		uring_queue(vmon, sys_stat->stat_fd, READ_COUNT(sys_stat->stat_size));
 
-	if (!array->array && grow_array(array, READLINKF_GROWINIT) < 0)
-		return -ENOMEM;
+	if ((vmon->sys_wants & VMON_WANT_SYS_VM) && sys_vm)
+		uring_queue(vmon, sys_vm->meminfo_fd, READ_COUNT(sys_vm->meminfo_size));
 
-	do {
-		len = readlinkat(dirfd(dir), buf, array->array, (array->alloc_len - 1));
-	} while (len != -1 && len == (array->alloc_len - 1) && (len = grow_array(array, READLINKF_GROWBY)) >= 0);
+	for (i = 0; i < (1 << vmon->htab_bits); i++) {
+		if ((proc = vmon->htab[i].proc)) {
+			int	wants = proc->wants ? proc->wants : vmon->proc_wants;
 
-	if (len < 0)
-		return -errno;
+			if (proc->is_stale)
+				continue;
 
-	array->len = len;
-	array->array[array->len] = '\0';
+			/* idle processes most likely won't be sampled, if they are after all it's just a pread() */
+			if ((vmon->flags & VMON_FLAG_ADAPTIVE) && proc->idle_countdown && !proc->reload)
+				wants &= ~IDLE_WANTS;
 
-	return 0;
-}
+			if ((wants & VMON_WANT_PROC_STAT) && proc->stores[VMON_STORE_PROC_STAT]) {
+				vmon_proc_stat_t	*proc_stat = proc->stores[VMON_STORE_PROC_STAT];
 
+				if (proc->reload)
+					uring_queue(vmon, proc_stat->cmdline_fd, READ_COUNT(proc_stat->cmdline.len));
+				uring_queue(vmon, proc_stat->wchan_fd, READ_COUNT(proc_stat->wchan.len));
+				uring_queue(vmon, proc_stat->stat_fd, READ_COUNT(proc_stat->stat_size));
+			}
 
-/* here starts private per-process samplers and other things like following children implementation etc. */
+			if ((wants & VMON_WANT_PROC_VM) && proc->stores[VMON_STORE_PROC_VM]) {
+				vmon_proc_vm_t	*proc_vm = proc->stores[VMON_STORE_PROC_VM];
 
-/* simple helper for installing callbacks on the callback lists, currently only used for the per-process sample callbacks */
-/* will not install the same callback function & arg combination more than once, and will not install NULL-functioned callbacks at all! */
-static int maybe_install_proc_callback(vmon_t *vmon, list_head_t *callbacks, void (*func)(vmon_t *, void *, vmon_proc_t *, void *), void *arg)
-{
-	assert(vmon);
-	assert(callbacks);
-	assert(!arg || func);
+				uring_queue(vmon, proc_vm->statm_fd, READ_COUNT(proc_vm->statm_size));
+			}
 
-	if (func) {
-		vmon_proc_callback_t	*cb;
+			if ((wants & VMON_WANT_PROC_IO) && proc->stores[VMON_STORE_PROC_IO]) {
+				vmon_proc_io_t	*proc_io = proc->stores[VMON_STORE_PROC_IO];
 
-		list_for_each_entry(cb, callbacks, callbacks) {
-			if (cb->func == func && cb->arg == arg)
-				break;
-		}
+				uring_queue(vmon, proc_io->io_fd, READ_COUNT(proc_io->io_size));
+			}
 
-		if (&cb->callbacks == callbacks) {
-			cb = calloc(1, sizeof(vmon_proc_callback_t));
-			if (!cb)
-				return 0;
+			if ((wants & VMON_WANT_PROC_SCHEDSTAT) && proc->stores[VMON_STORE_PROC_SCHEDSTAT]) {
+				vmon_proc_schedstat_t	*proc_schedstat = proc->stores[VMON_STORE_PROC_SCHEDSTAT];
 
-			cb->func = func;
-			cb->arg = arg;
-			list_add_tail(&cb->callbacks, callbacks);
+				uring_queue(vmon, proc_schedstat->schedstat_fd, READ_COUNT(proc_schedstat->schedstat_size));
+			}
+
+			if ((wants & VMON_WANT_PROC_FOLLOW_CHILDREN) && proc->stores[VMON_STORE_PROC_FOLLOW_CHILDREN] && read_children_files(vmon)) {
+				vmon_proc_follow_children_t	*children = proc->stores[VMON_STORE_PROC_FOLLOW_CHILDREN];
+
+				uring_queue(vmon, children->children_fd, READ_COUNT(children->children_size));
+			}
 		}
 	}
 
-	return 1;
+	if (uring_submit(vmon) < 0) {
+		/* the ring is broken somehow, give up on it for good and let everything pread() */
+		uring_close(vmon->uring);
+		vmon->uring = NULL;
+	}
 }
+#endif
 
 
-/* helper for searching for the process in the process array, specify NULL to find a free slot */
-static int find_proc_in_array(vmon_t *vmon, vmon_proc_t *proc, int hint)
+/* forget any prefetched contents for fd, needed whenever an fd number may have been reused */
+static void prefetch_forget(vmon_t *vmon, int fd)
 {
-	int	ret = -1;
-
-	assert(vmon);
+#ifdef HAVE_LINUX_IO_URING_H
+	if (vmon->uring && fd >= 0 && fd < vmon->uring->prefetch_alloc_nr)
+		vmon->uring->prefetch[fd].generation = 0;
+#endif
+}
 
-	if (hint >= 0 && hint < vmon->array_allocated_nr && vmon->array[hint] == proc) {
-		/* the hint was accurate, bypass the search */
-		ret = hint;
-	} else {
-		int	i;
 
-		/* search for the entry in the array */
-		for (i = 0; i < vmon->array_allocated_nr; i++) {
-			if (vmon->array[i] == proc) {
-				ret = i;
-				break;
-			}
+/* pread() of the start of fd for the samplers, serving from the prefetched reads when possible */
+static ssize_t sample_pread(vmon_t *vmon, int fd, void *buf, size_t count)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if (vmon->uring && fd >= 0 && fd < vmon->uring->prefetch_alloc_nr) {
+		prefetch_t	*prefetch = &vmon->uring->prefetch[fd];
+
+		/* only complete prefetches are of any use, a prefetch which filled its read may be truncated */
+		if (prefetch->generation == vmon->generation && prefetch->res >= 0 &&
+		    prefetch->res < prefetch->size && prefetch->res < count) {
+			memcpy(buf, &vmon->uring->arena[prefetch->offset], prefetch->res);
+			return prefetch->res;
 		}
 	}
+#endif
+	return try_pread(fd, buf, count, 0);
+}
 
-	if (!proc && ret == -1) {
-		vmon_proc_t	**tmp;
 
-		/* enlarge the array */
-		tmp = realloc(vmon->array, (vmon->array_allocated_nr + VMON_ARRAY_GROWBY) * sizeof(vmon_proc_t *));
-		if (tmp) {
-			memset(&tmp[vmon->array_allocated_nr], 0, VMON_ARRAY_GROWBY * sizeof(vmon_proc_t *));
-			ret = vmon->array_hint_free = vmon->array_allocated_nr;
-			vmon->array_allocated_nr += VMON_ARRAY_GROWBY;
-			vmon->array = tmp;
-		} /* XXX TODO: handle realloc failure */
-	}
+/* VMON_FLAG_PARALLEL worker pool.
+ * Pass 1 walks the hierarchy serially as always, but only invokes the samplers which alter the hierarchy or shared tables,
+ * queueing the nodes into a flat list.  The remaining per-process samplers are then run over that list by the pool, the
+ * calling thread included, with nodes claimed via an atomic index.  Pass 2 and its callbacks remain serial.
+ */
+#define POOL_SERIAL_WANTS	(VMON_WANT_PROC_FOLLOW_CHILDREN | VMON_WANT_PROC_FOLLOW_THREADS | VMON_WANT_PROC_FILES)
+#define POOL_MIN_NODES		64	/* below this many queued nodes we don't bother waking the workers */
+
+struct _vmon_pool_t {
+	pthread_mutex_t		lock;
+	pthread_cond_t		start_cond;		/* signalled when a new round of work is available */
+	pthread_cond_t		done_cond;		/* signalled when the last busy worker finishes a round */
+	pthread_t		*threads;
+	int			threads_nr;
+	unsigned		round;			/* incremented for every round of work */
+	int			busy;			/* workers still working on the current round */
+	int			quit;
+
+	pthread_mutex_t		slab_lock;		/* serializes the slab allocator while workers are sampling */
+	pthread_mutex_t		strs_lock;		/* serializes the interned strings table while workers are sampling */
+
+	vmon_t			*vmon;
+	vmon_proc_t		**nodes;		/* nodes queued by pass 1 */
+	int			nodes_nr, nodes_alloc_nr;
+	int			next;			/* next node to claim, atomically incremented */
+};
+
+
+/* slab allocator for the per-process objects, size classes of 32 bytes doubling through 4KiB are carved out of chunks and
+ * recycled via per-class free lists, so process churn doesn't keep going back to the heap.  Every object is prefixed by a
+ * header recording its class, larger objects come directly from the heap with a class of -1.  Chunks are cache line aligned
+ * with the headers placed so objects of a line or larger start on a line, which vmon_proc_t's layout relies on.
+ */
+#define SLAB_MIN_SHIFT		5
+#define SLAB_CHUNK_SIZE		(64 * 1024)
+#define SLAB_ALIGN		64
 
-	return ret;
+typedef union _slab_hdr_t {
+	int		class;		/* size class, -1 for heap allocations */
+	void		*next;		/* link when on a free list or heading a chunk */
+	max_align_t	align;
+} slab_hdr_t;
+
+
+static inline void slab_lock(vmon_t *vmon)
+{
+	if (vmon->pool)
+		pthread_mutex_lock(&vmon->pool->slab_lock);
 }
 
 
-/* this is the private variant that allows providing a parent, which libvmon needs for constructing hierarchies, but callers shouldn't be doing themselves */
-static vmon_proc_t * proc_monitor(vmon_t *vmon, vmon_proc_t *parent, int pid, vmon_proc_wants_t wants, void (*sample_cb)(vmon_t *, void *, vmon_proc_t *, void *), void *sample_cb_arg)
+static inline void slab_unlock(vmon_t *vmon)
 {
-	vmon_proc_t	*proc;
-	int		hash = (pid % VMON_HTAB_SIZE), i;
-	int		is_thread = (wants & VMON_INTERNAL_PROC_IS_THREAD) ? 1 : 0;
+	if (vmon->pool)
+		pthread_mutex_unlock(&vmon->pool->slab_lock);
+}
 
-	assert(vmon);
-	assert(!sample_cb_arg || sample_cb);
 
-	wants &= ~VMON_INTERNAL_PROC_IS_THREAD;
+static int slab_class(size_t size)
+{
+	int	class = 0;
 
-	if (pid < 0)
-		return NULL;
+	size += sizeof(slab_hdr_t);
+	while (class < VMON_SLAB_CLASSES && ((size_t)1 << (SLAB_MIN_SHIFT + class)) < size)
+		class++;
 
-	list_for_each_entry(proc, &vmon->htab[hash], bucket) {
-		/* search for the process to see if it's already monitored, we allow threads to exist with the same pid hence the additional is_thread comparison */
-		if (proc->pid == pid && proc->is_thread == is_thread) {
-			if (!maybe_install_proc_callback(vmon, &proc->sample_callbacks, sample_cb, sample_cb_arg))
-				return NULL;
+	return class < VMON_SLAB_CLASSES ? class : -1;
+}
 
-			proc->wants = wants; /* we can alter wants this way, though it clearly needs more consideration XXX */
-
-			if (parent) {
-				/* This is a predicament.  If the top-level (externally-established) process monitor wins the race, the process has no parent and is on the vmon->processes list.
-				 * Then the follow_children-established monitor comes along and wants to assign a parent, this isn't such a big deal, and we should be able to permit it, however,
-				 * we're in the process of iterating the top-level processes list when we run the follow_children() sampler of a descendant which happens to also be the parent.
-				 * We can't simply remove the process from the top-level processes list mid-iteration and stick it on the children list of the parent, the iterator could wind up
-				 * following the new pointer into the parents children.
-				 *
-				 * What I'm doing for now is allowing the assignment of a parent when there is no parent, but we don't perform the vmon->processes to parent->children migration
-				 * until the top-level sample_siblings() function sees the node with the parent.  At that point, the node will migrate to the parent's children list.  Since
-				 * this particular migration happens immediately within the same sample, it
-				 */
-				if (!proc->parent) {
-					/* if a parent was supplied, and there is no current parent, the process is top-level currently by external callers, but now appears to be a child of something as well,
-					 * so in this scenario, we'll remove it from the top-level siblings list, and make it a child of the new parent.  I don't think there needs to be concern about its being a thread here. */
-					/* Note we can't simply move the process from its current processes list and add it to the supplied parent's children list, as that would break the iterator above us at the top-level, so
-					 * we must defer the migration until the processes iterator context can do it for us - but this is tricky because we're in the middle of traversing our hierarchy and this process may
-					 * be in a critical is_new state which must be realized this sample at its location in the hierarchy for correctness, there will be no reappearance of that critical state in the correct
-					 * tree position for users like vwm. */
-					/* the VMON_FLAG_2PASS flag has been introduced for users like vwm */
-					proc->parent = parent;
-					proc->refcnt++;
-				}
-#if 0
-				else if (parent != proc->parent) {
-					/* We're switching parents; this used to be considered unexpected, but then vmon happened and it monitors the whole tree from PID1 down.
-					 * PID1 is special in that it inherits orphans, so we can already be monitoring a child of an exited parent, and here PID1's children
-					 * following is looking up a newly inherited orphan, which reaches here finding proc with a non-NULL, but different parent.
-					 * Note the introduction of PR_SET_CHILD_SUBREAPER has made this no longer limited to PID1 either.
-					 */
-					/* now, we can't simply switch parents in a single step... since the is_stale=1 state must be seen by the front-end before we can
-					 * unlink it from the structure in a subsequent sample.  So instead, we should be queueing an adoption by the new parent, but
-					 * for the time being we can just suppress the refcnt bump and let the adoptive parent reestablish the monitor anew after
-					 * runs its course under its current parent.
-					 */
-				}
-#endif
-			} else {
-				proc->refcnt++;
+
+/* allocate size zeroed bytes */
+static void * slab_alloc(vmon_t *vmon, size_t size)
+{
+	int		class = slab_class(size);
+	size_t		obj_size;
+	slab_hdr_t	*hdr;
+	vmon_slab_t	*slab;
+
+	if (class < 0) {
+		hdr = calloc(1, sizeof(slab_hdr_t) + size);
+		if (!hdr)
+			return NULL;
+
+		slab_lock(vmon);
+		vmon->slab_heap_nr++;
+		slab_unlock(vmon);
+
+		hdr->class = -1;
+
+		return hdr + 1;
+	}
+
+	obj_size = (size_t)1 << (SLAB_MIN_SHIFT + class);
+	slab = &vmon->slabs[class];
+
+	slab_lock(vmon);
+	if ((hdr = slab->free)) {
+		slab->free = hdr->next;
+		slab->free_nr--;
+	} else {
+		if (!slab->chunks || slab->chunk_used + obj_size > SLAB_CHUNK_SIZE) {
+			slab_hdr_t	*chunk;
+
+			chunk = aligned_alloc(SLAB_ALIGN, SLAB_CHUNK_SIZE);
+			if (!chunk) {
+				slab_unlock(vmon);
+				return NULL;
 			}
 
-			return proc;
+			chunk->next = slab->chunks;
+			slab->chunks = chunk;
+			slab->chunk_used = SLAB_ALIGN - sizeof(slab_hdr_t); /* the chunk link, then the first object's header ending on the line */
+			slab->chunks_nr++;
 		}
+
+		hdr = (slab_hdr_t *)((char *)slab->chunks + slab->chunk_used);
+		slab->chunk_used += obj_size;
 	}
+	slab->in_use_nr++;
+	slab_unlock(vmon);
 
-	proc = (vmon_proc_t *)calloc(1, sizeof(vmon_proc_t));
-	if (proc == NULL)
-		return NULL; /* TODO: report an error */
+	memset(hdr, 0, obj_size);
+	hdr->class = class;
 
-	proc->pid = pid;
-	proc->wants = wants;
-	proc->generation = vmon->generation;
-	proc->refcnt = 1;
-	proc->is_new = 1; /* newly created process */
-	proc->is_thread = is_thread;
-	proc->parent = parent;
-	INIT_LIST_HEAD(&proc->sample_callbacks);
-	INIT_LIST_HEAD(&proc->children);
-	INIT_LIST_HEAD(&proc->siblings);
-	INIT_LIST_HEAD(&proc->threads);
+	return hdr + 1;
+}
 
-	if (!maybe_install_proc_callback(vmon, &proc->sample_callbacks, sample_cb, sample_cb_arg)) {
-		free(proc);
-		return NULL;
+
+static void slab_free(vmon_t *vmon, void *ptr)
+{
+	slab_hdr_t	*hdr;
+	vmon_slab_t	*slab;
+
+	if (!ptr)
+		return;
+
+	hdr = (slab_hdr_t *)ptr - 1;
+	if (hdr->class < 0) {
+		free(hdr);
+
+		slab_lock(vmon);
+		vmon->slab_heap_nr--;
+		slab_unlock(vmon);
+
+		return;
 	}
 
-	if (parent) {
-		/* if a parent is specified, attach this process to the parent's children or threads with its siblings */
-		if (is_thread) {
-			list_add_tail(&proc->threads, &parent->threads);
-			parent->threads_changed = 1;
-			parent->is_threaded = 1;
-		} else {
-			list_add_tail(&proc->siblings, &parent->children);
-			parent->children_changed = 1;
-		}
+	slab = &vmon->slabs[hdr->class];
+
+	slab_lock(vmon);
+	hdr->next = slab->free;
+	slab->free = hdr;
+	slab->free_nr++;
+	slab->in_use_nr--;
+	slab_unlock(vmon);
+}
+
+
+/* like realloc(), growth within the object's size class is free */
+static void * slab_realloc(vmon_t *vmon, void *ptr, size_t size)
+{
+	slab_hdr_t	*hdr;
+	size_t		capacity;
+	void		*new;
+
+	if (!ptr)
+		return slab_alloc(vmon, size);
+
+	hdr = (slab_hdr_t *)ptr - 1;
+	if (hdr->class >= 0) {
+		capacity = ((size_t)1 << (SLAB_MIN_SHIFT + hdr->class)) - sizeof(slab_hdr_t);
+		if (size <= capacity)
+			return ptr;
 	} else {
-		/* if no parent is specified, this is a toplevel process, attach it to the vmon->processes list with its siblings */
-		/* XXX ignoring is_thread if no parent is specified, it shouldn't occur, unless I want to support external callers monitoring specific threads explicitly, maybe...  */
-		list_add_tail(&proc->siblings, &vmon->processes);
-		vmon->processes_changed = 1;
+		slab_hdr_t	*tmp;
+
+		tmp = realloc(hdr, sizeof(slab_hdr_t) + size);
+		if (!tmp)
+			return NULL;
+
+		return tmp + 1;
 	}
 
-	/* add this process to the hash table */
-	list_add_tail(&proc->bucket, &vmon->htab[hash]);
+	new = slab_alloc(vmon, size);
+	if (!new)
+		return NULL;
 
-	/* if process table maintenance is enabled acquire a free slot for this process */
-	if ((vmon->flags & VMON_FLAG_PROC_ARRAY) && (i = find_proc_in_array(vmon, NULL, vmon->array_hint_free)) != -1) {
-		vmon->array[i] = proc;
+	memcpy(new, ptr, capacity);
+	slab_free(vmon, ptr);
 
-		/* cache where we get inserted into the array */
-		proc->array_hint_pos = i;
-	}
+	return new;
+}
 
-	/* invoke ctor callback if set, note it's only called when a new vmon_proc_t has been instantiated */
-	if (vmon->proc_ctor_cb)
-		vmon->proc_ctor_cb(vmon, proc);
 
-	return proc;
+static void try_slab_free(vmon_t *vmon, void **ptr)
+{
+	assert(ptr);
+
+	if ((*ptr)) {
+		slab_free(vmon, (*ptr));
+		(*ptr) = NULL;
+	}
+}
+
+
+/* return all the slab chunks to the heap, everything allocated from them must already be unused */
+static void slab_destroy(vmon_t *vmon)
+{
+	int	i;
+
+	for (i = 0; i < VMON_SLAB_CLASSES; i++) {
+		slab_hdr_t	*chunk, *next;
+
+		for (chunk = vmon->slabs[i].chunks; chunk; chunk = next) {
+			next = chunk->next;
+			free(chunk);
+		}
+	}
+
+	memset(vmon->slabs, 0, sizeof(vmon->slabs));
+}
+
+
+/* scratch buffer for the samplers, which may run in VMON_FLAG_PARALLEL workers, the workers each use their own in place of vmon->buf */
+#define SAMPLE_BUF_SIZE	4096	/* initial size of the scratch buffers, they double from there as needed */
+
+static __thread int	is_worker;
+static __thread char	*worker_buf;
+static __thread size_t	worker_buf_size;
+
+/* get the scratch buffer enlarged to at least size, the contents are not preserved */
+static char * sample_buf(vmon_t *vmon, size_t size)
+{
+	char	**buf = is_worker ? &worker_buf : &vmon->buf;
+	size_t	*buf_size = is_worker ? &worker_buf_size : &vmon->buf_size;
+
+	if (size > *buf_size) {
+		size_t	new_size = *buf_size ? *buf_size : SAMPLE_BUF_SIZE;
+
+		while (new_size < size)
+			new_size <<= 1;
+
+		free(*buf);
+		*buf_size = 0;
+
+		*buf = malloc(new_size);
+		if (!*buf)
+			return NULL;
+
+		*buf_size = new_size;
+	}
+
+	return *buf;
+}
+
+/* read the entire contents of fd into the scratch buffer using a single pread(), proc files can only be read consistently in one go.
+ * *size is the contents length learned from previous reads of this file, when the contents fill the read they may have been
+ * truncated, so the read gets retried with a larger buffer.  Returns the length read with *res_buf pointing at the contents, or -1.
+ */
+static ssize_t read_contents(vmon_t *vmon, int fd, size_t *size, char **res_buf)
+{
+	size_t	count = READ_COUNT(*size);
+	ssize_t	len;
+	char	*buf;
+
+	assert(vmon);
+	assert(size);
+	assert(res_buf);
+
+	for (;;) {
+		buf = sample_buf(vmon, count);
+		if (!buf) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		len = sample_pread(vmon, fd, buf, count);
+		if (len < 0)
+			return len;
+
+		if (len < count)
+			break;
+
+		count <<= 1;
+	}
+
+	*size = len;
+	*res_buf = buf;
+
+	return len;
+}
+
+
+/* Like read_contents() but for the record-oriented seq_file proc files like children.  These only return as many whole records
+ * as fit a page per read regardless of the size asked for, so a short read isn't necessarily the end and reading one whole takes
+ * a pread() per page, which isn't atomic but there's no way around that.  A read shorter than RECORDS_CHUNK_MIN is the end.
+ */
+#define RECORDS_CHUNK_MIN	(4096 - 32)
+
+static ssize_t read_records(vmon_t *vmon, int fd, size_t *size, char **res_buf)
+{
+	size_t	count = READ_COUNT(*size), total;
+	ssize_t	len;
+	char	*buf;
+
+	assert(vmon);
+	assert(size);
+	assert(res_buf);
+
+	for (;;) {
+		buf = sample_buf(vmon, count);
+		if (!buf) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		total = 0;
+		len = sample_pread(vmon, fd, buf, count);
+		while (len > 0) {
+			total += len;
+			if (len < RECORDS_CHUNK_MIN || total == count)
+				break;
+
+			len = try_pread(fd, buf + total, count - total, total);
+		}
+
+		if (len < 0)
+			return -1;
+
+		if (total < count)
+			break;
+
+		count <<= 1;
+	}
+
+	*size = total;
+	*res_buf = buf;
+
+	return total;
+}
+
+
+/* String interning for the comm/cmdline/exe/wchan values of vmon_proc_stat_t, which tend to be identical across processes and
+ * all the more across the threads of a process.  The table is chained on vmon_str_t.bucket keyed on a hash of the contents, and
+ * every vmon_char_array_t pointing at interned contents holds a reference on them with a zero alloc_len.  Samplers compare what
+ * they read against the current contents and only intern on a difference, so unchanged contents cost a compare without a copy,
+ * and the consumers can tell identical values apart from changed ones by the pointer.
+ */
+#define STRS_BITS_MIN	8
+
+static inline void strs_lock(vmon_t *vmon)
+{
+	if (vmon->pool)
+		pthread_mutex_lock(&vmon->pool->strs_lock);
+}
+
+
+static inline void strs_unlock(vmon_t *vmon)
+{
+	if (vmon->pool)
+		pthread_mutex_unlock(&vmon->pool->strs_lock);
+}
+
+
+/* FNV-1a */
+static uint32_t str_hash(const char *contents, size_t len)
+{
+	uint32_t	hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*contents++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+
+static inline unsigned strs_bucket(vmon_strs_t *table, uint32_t hash)
+{
+	return (hash * 0x9e3779b9u) >> (32 - table->bits);
+}
+
+
+/* the interned string of the contents of a vmon_char_array_t */
+static inline vmon_str_t * str_of(const char *contents)
+{
+	return (vmon_str_t *)(contents - offsetof(vmon_str_t, str));
+}
+
+
+/* grow the table to keep the chains about one entry long, called with the strs lock held */
+static void strs_grow(vmon_strs_t *table)
+{
+	list_head_t	*old = table->buckets, *buckets;
+	int		old_bits = table->bits, bits = table->buckets ? table->bits + 1 : STRS_BITS_MIN;
+	int		i;
+
+	buckets = malloc(sizeof(list_head_t) << bits);
+	if (!buckets)
+		return; /* keep using the current table, the chains just get longer */
+
+	for (i = 0; i < (1 << bits); i++)
+		INIT_LIST_HEAD(&buckets[i]);
+
+	table->buckets = buckets;
+	table->bits = bits;
+
+	if (old) {
+		for (i = 0; i < (1 << old_bits); i++) {
+			vmon_str_t	*tmp, *_tmp;
+
+			list_for_each_entry_safe(tmp, _tmp, &old[i], bucket)
+				list_move_tail(&tmp->bucket, &buckets[strs_bucket(table, tmp->hash)]);
+		}
+
+		free(old);
+	}
+}
+
+
+/* get a reference on the interned copy of len bytes of contents, returns NULL on failure */
+static vmon_str_t * str_intern(vmon_t *vmon, const char *contents, size_t len)
+{
+	vmon_strs_t	*table = &vmon->strs;
+	uint32_t	hash = str_hash(contents, len);
+	vmon_str_t	*str;
+
+	strs_lock(vmon);
+	if (!table->buckets || table->nr >= (1 << table->bits))
+		strs_grow(table);
+
+	if (!table->buckets) {
+		str = NULL;
+		goto _out;
+	}
+
+	list_for_each_entry(str, &table->buckets[strs_bucket(table, hash)], bucket) {
+		if (str->hash == hash && str->len == len && !memcmp(str->str, contents, len)) {
+			str->refcnt++;
+			goto _out;
+		}
+	}
+
+	str = slab_alloc(vmon, sizeof(vmon_str_t) + len + 1);
+	if (!str)
+		goto _out;
+
+	str->hash = hash;
+	str->refcnt = 1;
+	str->len = len;
+	memcpy(str->str, contents, len);
+	str->str[len] = '\0';
+
+	list_add_tail(&str->bucket, &table->buckets[strs_bucket(table, hash)]);
+	table->nr++;
+
+_out:
+	strs_unlock(vmon);
+
+	return str;
+}
+
+
+/* drop a reference on an interned string */
+static void str_unref(vmon_t *vmon, vmon_str_t *str)
+{
+	int	refcnt;
+
+	strs_lock(vmon);
+	refcnt = --str->refcnt;
+	if (!refcnt) {
+		list_del(&str->bucket);
+		vmon->strs.nr--;
+	}
+	strs_unlock(vmon);
+
+	if (refcnt)
+		return;
+
+	try_slab_free(vmon, (void **)&str->argv);
+	slab_free(vmon, str);
+}
+
+
+/* build the argv of an interned cmdline if it hasn't been already, the pointers are into the contents and shared along with them */
+static void str_argv(vmon_t *vmon, vmon_str_t *str)
+{
+	int	argn, i;
+	char	*arg;
+
+	strs_lock(vmon);
+	if (str->argv || !str->len)
+		goto _out;
+
+	for (str->argc = 0, i = 0; i < str->len; i++) {
+		if (!str->str[i])
+			str->argc++;
+	}
+
+	if (!str->argc || !(str->argv = slab_alloc(vmon, str->argc * sizeof(char *)))) {
+		str->argc = 0;
+		goto _out;
+	}
+
+	for (argn = 0, arg = str->str, i = 0; i < str->len; i++) {
+		if (!str->str[i]) {
+			str->argv[argn++] = arg;
+			arg = &str->str[i + 1];
+		}
+	}
+
+_out:
+	strs_unlock(vmon);
+}
+
+
+/* drop array's reference on its interned contents, leaving it empty */
+static void char_array_release(vmon_t *vmon, vmon_char_array_t *array)
+{
+	if (array->array)
+		str_unref(vmon, str_of(array->array));
+
+	array->array = NULL;
+	array->len = 0;
+}
+
+
+/* make len bytes of contents the interned contents of array if they differ from its current contents, setting the changed bit */
+static int char_array_set(vmon_t *vmon, vmon_char_array_t *array, const char *contents, size_t len, char *changed, unsigned changed_pos)
+{
+	vmon_str_t	*str;
+
+	assert(vmon);
+	assert(array);
+	assert(contents);
+	assert(changed);
+
+	if (array->array && array->len == len && !memcmp(array->array, contents, len))
+		return 0;
+
+	str = str_intern(vmon, contents, len);
+	if (!str)
+		return -ENOMEM; /* the stale contents remain */
+
+	char_array_release(vmon, array);
+	array->array = str->str;
+	array->len = len;
+	BITSET(changed, changed_pos);
+
+	return 0;
+}
+
+
+typedef enum _vmon_load_flags_t {
+	LOAD_FLAGS_NONE		= 0,
+	LOAD_FLAGS_NOTRUNCATE	= 1L
+} vmon_load_flags_t;
+
+/* load the contents of fd interned into array, see char_array_set().  changed[changed_pos] bit is set if a difference is detected, supply LOAD_FLAGS_NOTRUNCATE if we don't want empty contents to truncate last-known data */
+static int load_contents_fd(vmon_t *vmon, vmon_char_array_t *array, int fd, vmon_load_flags_t flags, char *changed, unsigned changed_pos)
+{
+	size_t	size = array->len;	/* the last contents are the learned size */
+	ssize_t	len;
+	char	*buf;
+
+	assert(vmon);
+	assert(array);
+	assert(changed);
+
+	if (fd < 0) /* no use attempting the pread() on -1 fds */
+		return 0;
+
+	len = read_contents(vmon, fd, &size, &buf);
+	if (len > 0)
+		return char_array_set(vmon, array, buf, len, changed, changed_pos);
+
+	/* if we didn't encounter an error, the contents are now empty */
+	if (len == 0 && !(flags & LOAD_FLAGS_NOTRUNCATE) && array->len) {
+		char_array_release(vmon, array);
+		BITSET(changed, changed_pos);
+	}
+
+	return 0;
+}
+
+
+/* Per-process /proc handle cache.
+ * The handles the per-process samplers read through (stat, cmdline, wchan, statm, io, children) are counted against
+ * vmon_t.fd_budget, with the processes holding them kept on an LRU.  A process is considered used when its handles are about to
+ * be read, see fd_cache_restore().  Once over budget the least recently used processes have their handles closed and replaced
+ * with FD_EVICTED, which gets reopened on demand the next time the store is sampled.  The task/ and fd/ directory handles are
+ * walked every sample anyway so they're left alone.  The pidfds and perf_event handles can't be reopened, they're pinned: counted
+ * against the budget without ever being evicted, see fd_cache_pin().
+ */
+#define FD_EVICTED		-2	/* handle closed by the fd cache, as opposed to -1 for an open which failed for good */
+#define PROC_HANDLES_MAX	7
+
+typedef struct _proc_handle_t {
+	int		*fd;
+	const char	*name;	/* file in the process' /proc directory */
+	int		task;	/* name lives in task/$pid/ even for processes */
+} proc_handle_t;
+
+
+/* gather the cache-managed handles held by proc's stores for wants, returns how many */
+static int proc_handles(vmon_proc_t *proc, int wants, proc_handle_t *handles)
+{
+	int	n = 0;
+
+	if ((wants & VMON_WANT_PROC_STAT) && proc->stores[VMON_STORE_PROC_STAT]) {
+		vmon_proc_stat_t	*proc_stat = proc->stores[VMON_STORE_PROC_STAT];
+
+		handles[n++] = (proc_handle_t){ &proc_stat->stat_fd, "stat", 0 };
+		handles[n++] = (proc_handle_t){ &proc_stat->wchan_fd, "wchan", 0 };
+		handles[n++] = (proc_handle_t){ &proc_stat->cmdline_fd, "cmdline", 0 };
+	}
+
+	if ((wants & VMON_WANT_PROC_VM) && proc->stores[VMON_STORE_PROC_VM])
+		handles[n++] = (proc_handle_t){ &((vmon_proc_vm_t *)proc->stores[VMON_STORE_PROC_VM])->statm_fd, "statm", 0 };
+
+	if ((wants & VMON_WANT_PROC_IO) && proc->stores[VMON_STORE_PROC_IO])
+		handles[n++] = (proc_handle_t){ &((vmon_proc_io_t *)proc->stores[VMON_STORE_PROC_IO])->io_fd, "io", 0 };
+
+	if ((wants & VMON_WANT_PROC_SCHEDSTAT) && proc->stores[VMON_STORE_PROC_SCHEDSTAT])
+		handles[n++] = (proc_handle_t){ &((vmon_proc_schedstat_t *)proc->stores[VMON_STORE_PROC_SCHEDSTAT])->schedstat_fd, "schedstat", 0 };
+
+	if ((wants & VMON_WANT_PROC_FOLLOW_CHILDREN) && proc->stores[VMON_STORE_PROC_FOLLOW_CHILDREN])
+		handles[n++] = (proc_handle_t){ &((vmon_proc_follow_children_t *)proc->stores[VMON_STORE_PROC_FOLLOW_CHILDREN])->children_fd, "children", 1 };
+
+	assert(n <= PROC_HANDLES_MAX);
+
+	return n;
+}
+
+
+/* count the handles proc has open, keeping the totals current */
+static void fd_cache_count(vmon_t *vmon, vmon_proc_t *proc)
+{
+	proc_handle_t	handles[PROC_HANDLES_MAX];
+	int		i, n, nr = 0;
+
+	n = proc_handles(proc, ~0, handles);
+	for (i = 0; i < n; i++)
+		nr += *handles[i].fd >= 0;
+
+	vmon->fds_nr += nr - proc->fds_nr;
+	proc->fds_nr = nr;
+}
+
+
+/* close all the cache-managed handles of proc, they get reopened by fd_cache_restore() when next needed */
+static void fd_cache_evict(vmon_t *vmon, vmon_proc_t *proc)
+{
+	proc_handle_t	handles[PROC_HANDLES_MAX];
+	int		i, n;
+
+	n = proc_handles(proc, ~0, handles);
+	for (i = 0; i < n; i++) {
+		if (*handles[i].fd >= 0) {
+			close(*handles[i].fd);
+			*handles[i].fd = FD_EVICTED;
+		}
+	}
+
+	vmon->fds_nr -= proc->fds_nr;
+	proc->fds_nr = 0;
+	list_del_init(&proc->fd_lru);
+}
+
+
+/* evict the least recently used process to make room for an open, returns 0 if there's none which can be */
+static int fd_cache_shed(vmon_t *vmon)
+{
+	vmon_proc_t	*proc;
+
+	if (is_worker || list_empty(&vmon->fd_lru))
+		return 0; /* the LRU belongs to the sampling thread */
+
+	proc = list_entry(vmon->fd_lru.next, vmon_proc_t, fd_lru);
+	if (proc->fd_busy)
+		return 0; /* everything on the LRU is awaiting the samplers */
+
+	fd_cache_evict(vmon, proc);
+
+	return 1;
+}
+
+
+/* convenience function for opening a path using a format string, path is temporarily assembled in vmon->buf */
+static int openf(vmon_t *vmon, int flags, DIR *dir, char *fmt, ...)
+{
+	int	fd;
+	va_list	va_arg;
+	char	buf[4096];
+
+	assert(vmon);
+	assert(dir);
+	assert(fmt);
+
+	va_start(va_arg, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, va_arg); /* XXX accepting the possibility of truncating the path */
+	va_end(va_arg);
+
+	/* running out of fds is dealt with by shedding cached handles until there's nothing left to shed */
+	while ((fd = openat(dirfd(dir), buf, flags)) == -1 && errno == EMFILE && fd_cache_shed(vmon));
+	prefetch_forget(vmon, fd);
+
+	return fd;
+}
+
+
+/* convenience function for opening a directory using a format string, path is temporarily assembled in vmon->buf */
+static DIR * opendirf(vmon_t *vmon, DIR *dir, char *fmt, ...)
+{
+	int	fd;
+	va_list	va_arg;
+	char	buf[4096];
+
+	assert(vmon);
+	assert(dir);
+	assert(fmt);
+
+	va_start(va_arg, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, va_arg); /* XXX accepting the possibility of truncating the path */
+	va_end(va_arg);
+
+	while ((fd = openat(dirfd(dir), buf, O_RDONLY)) == -1 && errno == EMFILE && fd_cache_shed(vmon));
+	if (fd == -1)
+		return NULL;
+
+	prefetch_forget(vmon, fd);
+
+	return fdopendir(fd);
+}
+
+
+/* returns 1 if the process proc was monitoring has certainly been reaped, its pid may have been reused */
+static int pidfd_reaped(vmon_proc_t *proc)
+{
+	return proc->pidfd >= 0 && syscall(SYS_pidfd_send_signal, proc->pidfd, 0, NULL, 0) == -1 && errno == ESRCH;
+}
+
+
+/* open name in proc's /proc directory, threads are reached through their task directory, task forces that for processes too.
+ * Running out of fds isn't treated as a permanent failure, the handle is left for fd_cache_restore() to retry. */
+static int proc_openf(vmon_t *vmon, vmon_proc_t *proc, int task, const char *name)
+{
+	int	fd;
+
+	if (proc->is_thread || task)
+		fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/%s", proc->pid, proc->pid, name);
+	else
+		fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/%s", proc->pid, name);
+
+	if (fd == -1 && (errno == EMFILE || errno == ENFILE))
+		fd = FD_EVICTED;
+
+	/* a reaped process's pid may already be someone else's, don't let its files stand in for proc's (only the drain may flag it exited) */
+	if (fd >= 0 && pidfd_reaped(proc)) {
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+
+/* proc's handles for wants are about to be read, reopen any which were evicted and mark proc as recently used */
+static void fd_cache_restore(vmon_t *vmon, vmon_proc_t *proc, int wants)
+{
+	proc_handle_t	handles[PROC_HANDLES_MAX];
+	int		i, n;
+
+	if (!read_children_files(vmon))
+		wants &= ~VMON_WANT_PROC_FOLLOW_CHILDREN;
+
+	n = proc_handles(proc, wants, handles);
+	if (n) {
+		/* mark it used first so opening its handles can't shed it */
+		proc->fd_busy = 1;
+		list_move_tail(&proc->fd_lru, &vmon->fd_lru);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (*handles[i].fd == FD_EVICTED) {
+			*handles[i].fd = proc_openf(vmon, proc, handles[i].task, handles[i].name);
+			vmon->fd_cache_misses++;
+		} else if (*handles[i].fd >= 0) {
+			vmon->fd_cache_hits++;
+		}
+	}
+}
+
+
+/* proc has been sampled, account for the handles it now holds (the samplers open them on their first sample) */
+static void fd_cache_update(vmon_t *vmon, vmon_proc_t *proc)
+{
+	proc->fd_busy = 0;
+	fd_cache_count(vmon, proc);
+
+	if (!proc->fds_nr)
+		list_del_init(&proc->fd_lru);
+	else if (list_empty(&proc->fd_lru))
+		list_add_tail(&proc->fd_lru, &vmon->fd_lru);
+}
+
+
+/* account for n pinned handles having been opened, or closed when negative, the perf sampler may do so from the pool's threads */
+static void fd_cache_pin(vmon_t *vmon, int n)
+{
+	__atomic_add_fetch(&vmon->pinned_fds_nr, n, __ATOMIC_RELAXED);
+}
+
+
+/* evict the least recently used processes' handles until within budget */
+static void fd_cache_trim(vmon_t *vmon)
+{
+	while (vmon->fd_budget && vmon->fds_nr + vmon->pinned_fds_nr > vmon->fd_budget && !list_empty(&vmon->fd_lru))
+		fd_cache_evict(vmon, list_entry(vmon->fd_lru.next, vmon_proc_t, fd_lru));
+}
+
+
+/* enlarge an array by the specified amount */
+static int grow_array(vmon_t *vmon, vmon_char_array_t *array, size_t amount)
+{
+	char	*tmp;
+
+	assert(vmon);
+	assert(array);
+
+	tmp = slab_realloc(vmon, array->array, array->alloc_len + amount);
+	if (!tmp)
+		return -ENOMEM;
+
+	array->alloc_len += amount;
+	array->array = tmp;
+
+	return 0;
+}
+
+
+/* load the contents of a symlink, dir is not optional */
+#define READLINKF_GROWINIT	10
+#define READLINKF_GROWBY	2
+static int readlinkf(vmon_t *vmon, vmon_char_array_t *array, DIR *dir, char *fmt, ...)
+{
+	char	buf[4096];
+	va_list	va_arg;
+	ssize_t	len;
+
+	assert(vmon);
+	assert(array);
+	assert(dir);
+	assert(fmt);
+
+	va_start(va_arg, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, va_arg);
+	va_end(va_arg);
+
+	if (!array->array && grow_array(vmon, array, READLINKF_GROWINIT) < 0)
+		return -ENOMEM;
+
+	do {
+		len = readlinkat(dirfd(dir), buf, array->array, (array->alloc_len - 1));
+	} while (len != -1 && len == (array->alloc_len - 1) && (len = grow_array(vmon, array, READLINKF_GROWBY)) >= 0);
+
+	if (len < 0)
+		return -errno;
+
+	array->len = len;
+	array->array[array->len] = '\0';
+
+	return 0;
+}
+
+
+/* load the contents of a symlink interned into array, see char_array_set(), dir is not optional */
+static int readlinkf_str(vmon_t *vmon, vmon_char_array_t *array, char *changed, unsigned changed_pos, DIR *dir, char *fmt, ...)
+{
+	char	path[4096], *buf;
+	va_list	va_arg;
+	ssize_t	len;
+	size_t	size;
+
+	assert(vmon);
+	assert(array);
+	assert(dir);
+	assert(fmt);
+
+	va_start(va_arg, fmt);
+	vsnprintf(path, sizeof(path), fmt, va_arg);
+	va_end(va_arg);
+
+	for (size = PATH_MAX;; size <<= 1) {
+		buf = sample_buf(vmon, size);
+		if (!buf)
+			return -ENOMEM;
+
+		len = readlinkat(dirfd(dir), path, buf, size);
+		if (len < 0 || len < size)
+			break;
+	}
+
+	if (len < 0)
+		return -errno;
+
+	return char_array_set(vmon, array, buf, len, changed, changed_pos);
+}
+
+
+/* Bulk pid directory scanning for discovering processes in /proc and threads in /proc/$pid/task.
+ * The entries are read with raw getdents64 into the scratch buffer, bypassing readdir()'s small buffer, and only the numeric
+ * names are kept.  The kernel lists both directories in ascending pid order, which lets the callers find births and deaths
+ * with a merge against their pid-ordered lists instead of a search per entry.  proc_follow_children() reconciles the same
+ * way using the scratch arrays, see there.
+ */
+#define SCAN_BUF_SIZE		(64 * 1024)
+#define SCAN_DIRENT_MIN		24	/* smallest linux_dirent64 record: the 19 byte header and a 1 character name, 8-byte aligned */
+
+typedef struct _scan_dirent_t {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+} scan_dirent_t;
+
+/* grow one of the scan scratch arrays to hold at least nr elements, returns -1 on failure */
+static int scan_reserve(void **array, int *size, int nr, size_t elem_size)
+{
+	int	new_size = *size ? *size : SCAN_BUF_SIZE / SCAN_DIRENT_MIN;
+	void	*new_array;
+
+	if (nr <= *size)
+		return 0;
+
+	while (new_size < nr)
+		new_size <<= 1;
+
+	new_array = realloc(*array, new_size * elem_size);
+	if (!new_array)
+		return -1;
+
+	*array = new_array;
+	*size = new_size;
+
+	return 0;
+}
+
+
+/* parse a pid from a directory entry name, returns -1 for non-numeric names like "self" or ".." */
+static inline int scan_pid(const char *name)
+{
+	unsigned	digit = (unsigned char)*name - '0';
+	int		pid = digit;
+
+	if (digit > 9)
+		return -1;
+
+	while ((digit = (unsigned char)*++name - '0') <= 9)
+		pid = pid * 10 + digit;
+
+	return *name ? -1 : pid;
+}
+
+
+static int scan_pids_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+
+static int scan_procs_cmp(const void *a, const void *b)
+{
+	return (*(vmon_proc_t * const *)a)->pid - (*(vmon_proc_t * const *)b)->pid;
+}
+
+
+/* scan the numeric entries of dir into vmon->scan_pids in ascending order, returns how many or -1 on error */
+static int scan_pids(vmon_t *vmon, DIR *dir)
+{
+	int	fd = dirfd(dir), nr = 0, sorted = 1, last = -1;
+	char	*buf;
+	long	len;
+
+	buf = sample_buf(vmon, SCAN_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		return -1;
+
+	while ((len = syscall(SYS_getdents64, fd, buf, SCAN_BUF_SIZE)) > 0) {
+		long	off;
+
+		/* make room for every record this read could hold up front so the loop below needn't check */
+		if (scan_reserve((void **)&vmon->scan_pids, &vmon->scan_pids_size, nr + len / SCAN_DIRENT_MIN, sizeof(int)) < 0)
+			return -1;
+
+		for (off = 0; off < len; off += ((scan_dirent_t *)&buf[off])->d_reclen) {
+			int	pid = scan_pid(((scan_dirent_t *)&buf[off])->d_name);
+
+			if (pid < 0)
+				continue;
+
+			sorted &= pid > last;
+			vmon->scan_pids[nr++] = last = pid;
+		}
+	}
+
+	if (len < 0)
+		return -1;
+
+	/* the callers depend on the order, don't just assume it */
+	if (!sorted)
+		qsort(vmon->scan_pids, nr, sizeof(int), scan_pids_cmp);
+
+	return nr;
+}
+
+
+/* VMON_IMPLEMENT_FIELDS_PARSER support, see defs/_begin.def.
+ * The delimiters of the whole input are located up front, vectorized where possible, and recorded as an array of offsets so
+ * finding the end of a field is just a lookup instead of a serial scan.  Long fields are then converted 8 digits at a time.
+ */
+#define FIELDS_MAX_LEN	1024	/* longer inputs are left to the bytewise FSM */
+
+typedef struct _fields_t {
+	const char	*buf;
+	size_t		len;
+	size_t		pos;					/* cursor, the macros advance this through buf */
+	unsigned	tok;					/* index of the first delimiter at or after pos */
+	unsigned	n_delims;
+	uint16_t	delims[FIELDS_MAX_LEN + 1];		/* offsets of the delimiters in buf, terminated by len */
+} fields_t;
+
+
+/* record the delimiters set in mask as offsets from base */
+static inline unsigned fields_extract(uint16_t *delims, unsigned n, size_t base, uint64_t mask)
+{
+	for (; mask; mask &= mask - 1)
+		delims[n++] = base + __builtin_ctzll(mask);
+
+	return n;
+}
+
+
+/* prepare f for parsing buf, returns 0 if buf is too long */
+static int fields_init(fields_t *f, const char *buf, size_t len)
+{
+	size_t		i = 0;
+	unsigned	n = 0;
+
+	if (len > FIELDS_MAX_LEN)
+		return 0;
+
+	f->buf = buf;
+	f->len = len;
+	f->pos = 0;
+	f->tok = 0;
+
+#ifdef __AVX2__
+	for (; i + 32 <= len; i += 32) {
+		__m256i	v = _mm256_loadu_si256((const __m256i *)&buf[i]);
+
+		n = fields_extract(f->delims, n, i, (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+												     _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')))));
+	}
+#endif
+#ifdef __SSE2__
+	for (; i + 16 <= len; i += 16) {
+		__m128i	v = _mm_loadu_si128((const __m128i *)&buf[i]);
+
+		n = fields_extract(f->delims, n, i, (uint16_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+											   _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')))));
+	}
+#endif
+	for (; i < len; i++) {
+		if (buf[i] == ' ' || buf[i] == '\n')
+			f->delims[n++] = i;
+	}
+
+	f->delims[n] = len;
+	f->n_delims = n;
+
+	return 1;
+}
+
+
+/* find the first delimiter at or after the cursor, or the end of the input */
+static inline size_t fields_delim(fields_t *f)
+{
+	while (f->tok < f->n_delims && f->delims[f->tok] < f->pos)
+		f->tok++;
+
+	return f->delims[f->tok];
+}
+
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+/* convert the n (1-8) decimal digits at p, all 8 bytes at p must be readable */
+static inline uint64_t fields_digits8(const char *p, int n)
+{
+	uint64_t	v;
+
+	memcpy(&v, p, sizeof(v));
+	v <<= (8 - n) * 8;	/* discard what follows the digits, the vacated low bytes become leading zeros */
+
+	v = ((v & 0x0f0f0f0f0f0f0f0fULL) * 2561) >> 8;
+	v = ((v & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+	v = ((v & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32;
+
+	return v;
+}
+#endif
+
+
+/* convert the unsigned field at the cursor, leaving the cursor at its delimiter */
+static inline unsigned long long fields_ulonglong(fields_t *f)
+{
+	size_t			end = fields_delim(f);
+	const char		*p = &f->buf[f->pos];
+	size_t			n = end - f->pos;
+	unsigned long long	v = 0;
+
+	f->pos = end;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* short fields are the norm, SWAR only pays off for the longer ones */
+	if (n > 4 && p + 8 <= f->buf + f->len) {
+		int	k = ((n - 1) & 7) + 1;	/* leading partial chunk, the rest are whole chunks of 8 */
+
+		v = fields_digits8(p, k);
+		for (p += k, n -= k; n; p += 8, n -= 8)
+			v = v * 100000000 + fields_digits8(p, 8);
+
+		return v;
+	}
+#endif
+	for (; n; p++, n--)
+		v = v * 10 + (*p - '0');
+
+	return v;
+}
+
+
+/* convert the signed field at the cursor, leaving the cursor at its delimiter */
+static inline long long fields_longlong(fields_t *f)
+{
+	if (f->pos < f->len && f->buf[f->pos] == '-') {
+		f->pos++;
+
+		return -(long long)fields_ulonglong(f);
+	}
+
+	return fields_ulonglong(f);
+}
+
+
+/* here starts private per-process samplers and other things like following children implementation etc. */
+
+/* simple helper for installing callbacks on the callback lists, currently only used for the per-process sample callbacks */
+/* will not install the same callback function & arg combination more than once, and will not install NULL-functioned callbacks at all! */
+static int maybe_install_proc_callback(vmon_t *vmon, list_head_t *callbacks, void (*func)(vmon_t *, void *, vmon_proc_t *, void *), void *arg)
+{
+	assert(vmon);
+	assert(callbacks);
+	assert(!arg || func);
+
+	if (func) {
+		vmon_proc_callback_t	*cb;
+
+		list_for_each_entry(cb, callbacks, callbacks) {
+			if (cb->func == func && cb->arg == arg)
+				break;
+		}
+
+		if (&cb->callbacks == callbacks) {
+			cb = calloc(1, sizeof(vmon_proc_callback_t));
+			if (!cb)
+				return 0;
+
+			cb->func = func;
+			cb->arg = arg;
+			list_add_tail(&cb->callbacks, callbacks);
+		}
+	}
+
+	return 1;
+}
+
+
+/* processes array helpers, the array grows geometrically with the vacated indices kept on a stack for reuse, and each process
+ * records its own index so removal needn't search */
+
+/* place proc in a free slot of the processes array, returns its index or -1 on failure */
+static int array_insert(vmon_t *vmon, vmon_proc_t *proc)
+{
+	int	i;
+
+	assert(vmon);
+	assert(proc);
+
+	if (!vmon->array_free_nr) {
+		int		new_nr = vmon->array_allocated_nr ? vmon->array_allocated_nr * 2 : VMON_ARRAY_MIN;
+		vmon_proc_t	**new_array;
+		int		*new_free;
+
+		new_array = realloc(vmon->array, new_nr * sizeof(vmon_proc_t *));
+		if (!new_array)
+			return -1;
+
+		vmon->array = new_array;
+
+		new_free = realloc(vmon->array_free, new_nr * sizeof(int));
+		if (!new_free)
+			return -1; /* array is simply larger than it needs to be until the next attempt */
+
+		vmon->array_free = new_free;
+
+		memset(&vmon->array[vmon->array_allocated_nr], 0, (new_nr - vmon->array_allocated_nr) * sizeof(vmon_proc_t *));
+
+		/* push the new indices highest first so they get handed out in ascending order */
+		for (i = new_nr - 1; i >= vmon->array_allocated_nr; i--)
+			vmon->array_free[vmon->array_free_nr++] = i;
+
+		vmon->array_allocated_nr = new_nr;
+	}
+
+	i = vmon->array_free[--vmon->array_free_nr];
+	vmon->array[i] = proc;
+	vmon->array_active_nr++;
+
+	return i;
+}
+
+
+/* vacate proc's slot in the processes array, if it has one */
+static void array_remove(vmon_t *vmon, vmon_proc_t *proc)
+{
+	assert(vmon);
+	assert(proc);
+
+	if (proc->array_pos < 0)
+		return;
+
+	assert(vmon->array[proc->array_pos] == proc);
+
+	vmon->array[proc->array_pos] = NULL;
+	vmon->array_free[vmon->array_free_nr++] = proc->array_pos;
+	vmon->array_active_nr--;
+	proc->array_pos = -1;
+}
+
+
+/* VMON_FLAG_2PASS traversal order, the hierarchy flattened into arrays so both passes sweep them instead of chasing the lists
+ * through scattered processes.  The order is rebuilt by pass 2 whenever the hierarchy changed since it was last built, which is
+ * detected by a counter bumped at every linking or unlinking of a process.  Pass 1 samples in pre-order, with each node recording
+ * the end of its subtree so when sampling a node changes the hierarchy beneath it, just that subtree gets walked from the lists.
+ * Pass 2 invokes the callbacks in post-order, which only holds processes as threads aren't called back.
+ */
+typedef struct _order_node_t {
+	vmon_proc_t	*proc;
+	int		end;		/* index just past proc's subtree */
+	int		toplevel;	/* proc is on the top-level processes list */
+} order_node_t;
+
+struct _vmon_order_t {
+	order_node_t	*pre;		/* pass 1 order */
+	vmon_proc_t	**post;		/* pass 2 order */
+	int		pre_nr, pre_size;
+	int		post_nr, post_size;
+	unsigned	changes;	/* bumped by hierarchy_changed() */
+	unsigned	built;		/* changes when pre and post were last built */
+	unsigned	building:1;	/* pass 2 is recording the order */
+	unsigned	valid:1;	/* pre and post hold the complete hierarchy as of built */
+};
+
+
+static void order_destroy(struct _vmon_order_t *order)
+{
+	if (!order)
+		return;
+
+	try_free((void **)&order->pre);
+	try_free((void **)&order->post);
+	free(order);
+}
+
+
+/* note a process being linked into or unlinked from the hierarchy */
+static inline void hierarchy_changed(vmon_t *vmon)
+{
+	if (vmon->order)
+		vmon->order->changes++;
+}
+
+
+/* is the order usable for sampling? */
+static inline int order_current(vmon_t *vmon)
+{
+	return vmon->order && vmon->order->valid && vmon->order->built == vmon->order->changes;
+}
+
+
+/* start recording the order, every process is in the hash table so that bounds it */
+static void order_begin(vmon_t *vmon)
+{
+	struct _vmon_order_t	*order = vmon->order;
+
+	if (!order)
+		return;
+
+	order->valid = 0;
+	order->pre_nr = order->post_nr = 0;
+	order->built = order->changes;
+	order->building = (scan_reserve((void **)&order->pre, &order->pre_size, vmon->htab_nr, sizeof(order_node_t)) == 0 &&
+			   scan_reserve((void **)&order->post, &order->post_size, vmon->htab_nr, sizeof(vmon_proc_t *)) == 0);
+}
+
+
+/* record proc entering the order, returns its pre-order index or -1 when not recording */
+static int order_enter(vmon_t *vmon, vmon_proc_t *proc, int toplevel)
+{
+	struct _vmon_order_t	*order = vmon->order;
+
+	if (!order || !order->building)
+		return -1;
+
+	if (order->pre_nr >= order->pre_size) {
+		/* callbacks have monitored more processes than the hash table held, try again next time */
+		order->building = 0;
+		return -1;
+	}
+
+	order->pre[order->pre_nr] = (order_node_t){ .proc = proc, .toplevel = toplevel };
+
+	return order->pre_nr++;
+}
+
+
+/* record the end of the subtree entered at pre, a process (not a thread) is appended to the post-order too */
+static void order_leave(vmon_t *vmon, int pre, vmon_proc_t *proc)
+{
+	struct _vmon_order_t	*order = vmon->order;
+
+	if (pre < 0 || !order->building)
+		return;
+
+	order->pre[pre].end = order->pre_nr;
+	if (proc)
+		order->post[order->post_nr++] = proc;
+}
+
+
+static void order_end(vmon_t *vmon)
+{
+	struct _vmon_order_t	*order = vmon->order;
+
+	if (!order)
+		return;
+
+	order->valid = order->building;
+	order->building = 0;
+}
+
+
+/* processes hash table helpers, open addressing with linear probing on a multiplicative hash of (pid << 1) | is_thread */
+static inline uint32_t htab_key(int pid, int is_thread)
+{
+	return ((uint32_t)pid << 1) | is_thread;
+}
+
+
+static inline unsigned htab_slot(vmon_t *vmon, uint32_t key)
+{
+	return (key * 2654435769u) >> (32 - vmon->htab_bits);
+}
+
+
+/* add proc to the hash table, it must not already be present, grows the table to stay at most half full */
+static int htab_insert(vmon_t *vmon, vmon_proc_t *proc)
+{
+	unsigned	mask, i;
+	uint32_t	key = htab_key(proc->pid, proc->is_thread);
+
+	if ((vmon->htab_nr + 1) * 2 > (1 << vmon->htab_bits)) {
+		vmon_htab_slot_t	*old = vmon->htab, *htab;
+		unsigned		old_size = 1 << vmon->htab_bits;
+
+		htab = calloc(old_size * 2, sizeof(vmon_htab_slot_t));
+		if (!htab)
+			return -ENOMEM;
+
+		vmon->htab = htab;
+		vmon->htab_bits++;
+		mask = (1 << vmon->htab_bits) - 1;
+
+		for (i = 0; i < old_size; i++) {
+			unsigned	j;
+
+			if (!old[i].proc)
+				continue;
+
+			for (j = htab_slot(vmon, old[i].key); htab[j].proc; j = (j + 1) & mask);
+			htab[j] = old[i];
+		}
+
+		free(old);
+	}
+
+	mask = (1 << vmon->htab_bits) - 1;
+	for (i = htab_slot(vmon, key); vmon->htab[i].proc; i = (i + 1) & mask);
+
+	vmon->htab[i].key = key;
+	vmon->htab[i].proc = proc;
+	vmon->htab_nr++;
+
+	return 0;
+}
+
+
+/* remove proc from the hash table, shifting back any displaced entries following it so lookups never need tombstones */
+static void htab_remove(vmon_t *vmon, vmon_proc_t *proc)
+{
+	unsigned	mask = (1 << vmon->htab_bits) - 1, i, j;
+
+	for (i = htab_slot(vmon, htab_key(proc->pid, proc->is_thread)); vmon->htab[i].proc != proc; i = (i + 1) & mask) {
+		if (!vmon->htab[i].proc)
+			return; /* not present */
+	}
+
+	for (j = (i + 1) & mask; vmon->htab[j].proc; j = (j + 1) & mask) {
+		unsigned	home = htab_slot(vmon, vmon->htab[j].key);
+
+		/* entries whose home lies cyclically within (i, j] are still reachable, the rest move into the hole */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			vmon->htab[i] = vmon->htab[j];
+			i = j;
+		}
+	}
+
+	vmon->htab[i].proc = NULL;
+	vmon->htab_nr--;
+}
+
+
+/* flag proc as exited, it becomes stale in its parent's next proc_follow_children() */
+static void proc_exited(vmon_t *vmon, vmon_proc_t *proc)
+{
+	vmon_proc_t	*child;
+
+	proc->exited = 1;
+
+	if (vmon->proc_events_fd == -1)
+		return;
+
+	/* surviving children get reparented to a subreaper the proc connector doesn't identify, fall back to the children files.
+	 * The subreaper can only take them in once this process has gone stale and been removed, so keep reading the
+	 * children files next sample too. */
+	list_for_each_entry(child, &proc->children, siblings) {
+		if (!child->exited) {
+			vmon->proc_events_rescan = 1;
+			vmon->proc_events_rescan_next = 1;
+			break;
+		}
+	}
+}
+
+
+/* VMON_FLAG_PIDFD support.
+ * Every monitored process holds a pidfd registered with the vmon->pidfds_fd epoll instance, which becomes readable when any of
+ * them exits.  Unlike the pid, a pidfd stays bound to the process it was opened for, once that process has been reaped
+ * signalling it fails with ESRCH even if its pid has since been reused, so a reused pid can't pass for the process we've been
+ * monitoring.  Threads are left to proc_follow_threads().
+ */
+#define PIDFDS_EVENTS	64
+
+/* open and watch a pidfd for the newly monitored proc */
+static void pidfds_insert(vmon_t *vmon, vmon_proc_t *proc)
+{
+	struct epoll_event	ev = { .events = EPOLLIN, .data.ptr = proc };
+
+	proc->pidfd = -1;
+	if (vmon->pidfds_fd == -1 || proc->is_thread)
+		return;
+
+	while ((proc->pidfd = syscall(SYS_pidfd_open, proc->pid, 0)) == -1 && errno == EMFILE && fd_cache_shed(vmon));
+	if (proc->pidfd == -1) {
+		if (errno == ESRCH)
+			proc->exited = 1;
+
+		return; /* otherwise it's just tracked by its pid */
+	}
+
+	if (epoll_ctl(vmon->pidfds_fd, EPOLL_CTL_ADD, proc->pidfd, &ev) == -1) {
+		try_close(&proc->pidfd);
+
+		return;
+	}
+
+	fd_cache_pin(vmon, 1);
+}
+
+
+/* flag the processes whose pidfds became readable as exited, called at the start of every sample before the hierarchy is walked */
+static void pidfds_drain(vmon_t *vmon)
+{
+	struct epoll_event	events[PIDFDS_EVENTS];
+	int			i, n;
+
+	assert(vmon);
+
+	do {
+		n = epoll_wait(vmon->pidfds_fd, events, PIDFDS_EVENTS, 0);
+		for (i = 0; i < n; i++) {
+			vmon_proc_t	*proc = events[i].data.ptr;
+
+			/* the pidfd stays readable, it's only kept for pidfd_reaped() from here on */
+			epoll_ctl(vmon->pidfds_fd, EPOLL_CTL_DEL, proc->pidfd, NULL);
+			proc_exited(vmon, proc);
+		}
+	} while (n == PIDFDS_EVENTS);
+}
+
+
+/* this is the private variant that allows providing a parent, which libvmon needs for constructing hierarchies, but callers shouldn't be doing themselves */
+static vmon_proc_t * proc_monitor(vmon_t *vmon, vmon_proc_t *parent, int pid, vmon_proc_wants_t wants, void (*sample_cb)(vmon_t *, void *, vmon_proc_t *, void *), void *sample_cb_arg)
+{
+	vmon_proc_t	*proc;
+	int		is_thread = (wants & VMON_INTERNAL_PROC_IS_THREAD) ? 1 : 0;
+
+	assert(vmon);
+	assert(!sample_cb_arg || sample_cb);
+
+	wants &= ~VMON_INTERNAL_PROC_IS_THREAD;
+
+	if (pid < 0)
+		return NULL;
+
+	/* search for the process to see if it's already monitored, we allow threads to exist with the same pid hence the is_thread distinction */
+	if ((proc = vmon_proc_lookup(vmon, pid, is_thread))) {
+		if (!maybe_install_proc_callback(vmon, &proc->sample_callbacks, sample_cb, sample_cb_arg))
+			return NULL;
+
+		proc->wants = wants; /* we can alter wants this way, though it clearly needs more consideration XXX */
+
+		if (parent) {
+			/* This is a predicament.  If the top-level (externally-established) process monitor wins the race, the process has no parent and is on the vmon->processes list.
+			 * Then the follow_children-established monitor comes along and wants to assign a parent, this isn't such a big deal, and we should be able to permit it, however,
+			 * we're in the process of iterating the top-level processes list when we run the follow_children() sampler of a descendant which happens to also be the parent.
+			 * We can't simply remove the process from the top-level processes list mid-iteration and stick it on the children list of the parent, the iterator could wind up
+			 * following the new pointer into the parents children.
+			 *
+			 * What I'm doing for now is allowing the assignment of a parent when there is no parent, but we don't perform the vmon->processes to parent->children migration
+			 * until the top-level sample_siblings() function sees the node with the parent.  At that point, the node will migrate to the parent's children list.  Since
+			 * this particular migration happens immediately within the same sample, it
+			 */
+			if (!proc->parent) {
+				/* if a parent was supplied, and there is no current parent, the process is top-level currently by external callers, but now appears to be a child of something as well,
+				 * so in this scenario, we'll remove it from the top-level siblings list, and make it a child of the new parent.  I don't think there needs to be concern about its being a thread here. */
+				/* Note we can't simply move the process from its current processes list and add it to the supplied parent's children list, as that would break the iterator above us at the top-level, so
+				 * we must defer the migration until the processes iterator context can do it for us - but this is tricky because we're in the middle of traversing our hierarchy and this process may
+				 * be in a critical is_new state which must be realized this sample at its location in the hierarchy for correctness, there will be no reappearance of that critical state in the correct
+				 * tree position for users like vwm. */
+				/* the VMON_FLAG_2PASS flag has been introduced for users like vwm */
+				proc->parent = parent;
+				proc->refcnt++;
+			}
+#if 0
+			else if (parent != proc->parent) {
+				/* We're switching parents; this used to be considered unexpected, but then vmon happened and it monitors the whole tree from PID1 down.
+				 * PID1 is special in that it inherits orphans, so we can already be monitoring a child of an exited parent, and here PID1's children
+				 * following is looking up a newly inherited orphan, which reaches here finding proc with a non-NULL, but different parent.
+				 * Note the introduction of PR_SET_CHILD_SUBREAPER has made this no longer limited to PID1 either.
+				 */
+				/* now, we can't simply switch parents in a single step... since the is_stale=1 state must be seen by the front-end before we can
+				 * unlink it from the structure in a subsequent sample.  So instead, we should be queueing an adoption by the new parent, but
+				 * for the time being we can just suppress the refcnt bump and let the adoptive parent reestablish the monitor anew after
+				 * runs its course under its current parent.
+				 */
+			}
+#endif
+		} else {
+			proc->refcnt++;
+		}
+
+		return proc;
+	}
+
+	proc = (vmon_proc_t *)slab_alloc(vmon, sizeof(vmon_proc_t));
+	if (proc == NULL)
+		return NULL; /* TODO: report an error */
+
+	proc->pid = pid;
+	proc->wants = wants;
+	proc->generation = vmon->generation;
+	proc->refcnt = 1;
+	proc->is_new = 1; /* newly created process */
+	proc->is_thread = is_thread;
+	proc->parent = parent;
+	INIT_LIST_HEAD(&proc->sample_callbacks);
+	INIT_LIST_HEAD(&proc->children);
+	INIT_LIST_HEAD(&proc->siblings);
+	INIT_LIST_HEAD(&proc->threads);
+	INIT_LIST_HEAD(&proc->fd_lru);
+
+	/* add this process to the hash table */
+	if (htab_insert(vmon, proc) < 0) {
+		slab_free(vmon, proc);
+		return NULL;
+	}
+
+	if (!maybe_install_proc_callback(vmon, &proc->sample_callbacks, sample_cb, sample_cb_arg)) {
+		htab_remove(vmon, proc);
+		slab_free(vmon, proc);
+		return NULL;
+	}
+
+	if (parent) {
+		/* if a parent is specified, attach this process to the parent's children or threads with its siblings */
+		if (is_thread) {
+			list_add_tail(&proc->threads, &parent->threads);
+			parent->threads_changed = 1;
+			parent->is_threaded = 1;
+		} else {
+			list_add_tail(&proc->siblings, &parent->children);
+			parent->children_changed = 1;
+		}
+	} else {
+		/* if no parent is specified, this is a toplevel process, attach it to the vmon->processes list with its siblings */
+		/* XXX ignoring is_thread if no parent is specified, it shouldn't occur, unless I want to support external callers monitoring specific threads explicitly, maybe...  */
+		list_add_tail(&proc->siblings, &vmon->processes);
+		vmon->processes_changed = 1;
+	}
+	hierarchy_changed(vmon);
+
+	pidfds_insert(vmon, proc);
+
+	/* if process table maintenance is enabled acquire a free slot for this process */
+	proc->array_pos = -1;
+	if ((vmon->flags & VMON_FLAG_PROC_ARRAY))
+		proc->array_pos = array_insert(vmon, proc); /* XXX TODO: handle failure */
+
+	/* invoke ctor callback if set, note it's only called when a new vmon_proc_t has been instantiated */
+	if (vmon->proc_ctor_cb)
+		vmon->proc_ctor_cb(vmon, proc);
+
+	return proc;
+}
+
+
+/* subscribe to the netlink proc connector, requires CAP_NET_ADMIN, returns the socket or -1 */
+static int proc_events_open(void)
+{
+	struct sockaddr_nl	addr = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC };
+	int			fd, rcvbuf = 1024 * 1024;
+	struct __attribute__((aligned(NLMSG_ALIGNTO))) {
+		struct nlmsghdr	hdr;
+		struct __attribute__((__packed__)) {
+			struct cn_msg		msg;
+			enum proc_cn_mcast_op	op;
+		};
+	} req = {
+		.hdr.nlmsg_len = sizeof(req),
+		.hdr.nlmsg_type = NLMSG_DONE,
+		.msg.id.idx = CN_IDX_PROC,
+		.msg.id.val = CN_VAL_PROC,
+		.msg.len = sizeof(enum proc_cn_mcast_op),
+		.op = PROC_CN_MCAST_LISTEN,
+	};
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd == -1)
+		return -1;
+
+	/* fork storms can produce a lot of events between samples, overflows cost us a full rescan so try get a roomy buffer */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+	    send(fd, &req, sizeof(req), 0) != sizeof(req)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* consume the queued proc connector events, called at the start of every sample before the hierarchy is walked.
+ * forks of followed processes are monitored immediately, exits merely flag the process for proc_follow_children() to make stale.
+ */
+static void proc_events_drain(vmon_t *vmon)
+{
+	struct sockaddr_nl	addr;
+	socklen_t		addrlen;
+	ssize_t			len;
+	char			*buf;
+
+	assert(vmon);
+
+	buf = sample_buf(vmon, SAMPLE_BUF_SIZE);
+	if (!buf) {
+		vmon->proc_events_rescan = 1;
+		return;
+	}
+
+	vmon->proc_events_rescan = vmon->proc_events_rescan_next;
+	vmon->proc_events_rescan_next = 0;
+
+	for (;;) {
+		struct nlmsghdr	*hdr;
+
+		addrlen = sizeof(addr);
+		len = recvfrom(vmon->proc_events_fd, buf, SAMPLE_BUF_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == ENOBUFS) {
+				/* we've lost events, the children files are all we can trust this sample */
+				vmon->proc_events_rescan = 1;
+				continue;
+			}
+
+			break; /* EAGAIN, drained */
+		}
+
+		if (addr.nl_pid != 0) /* only the kernel gets to tell us about processes */
+			continue;
+
+		for (hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+			struct cn_msg		*msg = NLMSG_DATA(hdr);
+			struct proc_event	event = {}, *ev = &event;
+			vmon_proc_t		*proc, *child;
+
+			if (hdr->nlmsg_type != NLMSG_DONE || msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+				continue;
+
+			/* the event payload follows the 20 byte cn_msg header and isn't suitably aligned for direct access */
+			memcpy(&event, msg->data, msg->len < sizeof(event) ? msg->len : sizeof(event));
+
+			switch (ev->what) {
+				case PROC_EVENT_FORK:
+					/* new threads are left to proc_follow_threads() */
+					if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+						break;
+
+					/* the children files are per-task, so a fork from a non-leader thread belongs to that thread's node */
+					proc = vmon_proc_lookup(vmon, ev->event_data.fork.parent_pid, ev->event_data.fork.parent_pid != ev->event_data.fork.parent_tgid);
+
+					/* only parents which have already read their children file are kept current this way, the others will find the child on their first sample */
+					if (!proc || proc->is_stale || !proc->stores[VMON_STORE_PROC_FOLLOW_CHILDREN])
+						break;
+
+					child = vmon_proc_lookup(vmon, ev->event_data.fork.child_pid, 0);
+					if (child && child->exited) {
+						/* pid reuse of a process we haven't finished removing, have the children files sort it out once the old one is gone */
+						vmon->proc_events_rescan_next = 1;
+						break;
+					}
+
+					proc_monitor(vmon, proc, ev->event_data.fork.child_pid, proc->wants, NULL, NULL);
+					break;
+
+				case PROC_EVENT_EXIT:
+					/* thread exits are left to proc_follow_threads() */
+					if (ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid)
+						break;
+
+					proc = vmon_proc_lookup(vmon, ev->event_data.exit.process_pid, 0);
+					if (!proc)
+						break;
+
+					proc_exited(vmon, proc);
+					break;
+
+				case PROC_EVENT_EXEC:
+				case PROC_EVENT_COMM:
+					/* have proc_sample_stat() revisit the exec-sensitive string files, even if it can't tell from stat */
+					if ((proc = vmon_proc_lookup(vmon, ev->event_data.exec.process_tgid, 0)))
+						proc->reload = 1;
+
+					if ((proc = vmon_proc_lookup(vmon, ev->event_data.exec.process_pid, 1)))
+						proc->reload = 1;
+					break;
+
+				default:
+					break;
+			}
+		}
+	}
+}
+
+
+/* VMON_WANT_PROC_EXIT support.
+ * The taskstats exit notifications carry the exact totals of every task exiting on the cpus we've registered for, so the
+ * final stretch since a process was last sampled isn't lost.  They're drained at the start of every sample, before the
+ * exits become stale in the hierarchy, and summed into the exit stores of the processes and threads they belong to.
+ * The group's final notification (AGROUP) completes a process, its pid and tgid identify the task (v12).
+ */
+
+/* send a generic netlink request carrying a single attribute */
+static int genl_send(int fd, int family, int flags, int cmd, int type, const void *data, int len)
+{
+	struct {
+		struct nlmsghdr		hdr;
+		struct genlmsghdr	genl;
+		struct nlattr		nla;
+		char			data[64];
+	} req = {
+		.hdr.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + len),
+		.hdr.nlmsg_type = family,
+		.hdr.nlmsg_flags = NLM_F_REQUEST | flags,
+		.genl.cmd = cmd,
+		.genl.version = 1,
+		.nla.nla_type = type,
+		.nla.nla_len = NLA_HDRLEN + len,
+	};
+
+	assert(len <= sizeof(req.data));
+
+	memcpy(req.data, data, len);
+
+	return send(fd, &req, req.hdr.nlmsg_len, 0) == req.hdr.nlmsg_len ? 0 : -1;
+}
+
+
+/* find the attribute of type among the len bytes of attributes at attrs, NULL if it's absent */
+static struct nlattr * nla_find(void *attrs, int len, int type)
+{
+	struct nlattr	*nla = attrs;
+
+	while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == type)
+			return nla;
+
+		len -= NLA_ALIGN(nla->nla_len);
+		nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+
+	return NULL;
+}
+
+
+/* register for the taskstats exit notifications of every cpu, requires CAP_NET_ADMIN in the initial namespaces,
+ * returns the socket or -1, with the family to expect the notifications from stored in res_family */
+static int taskstats_open(int *res_family)
+{
+	struct sockaddr_nl	addr = { .nl_family = AF_NETLINK };
+	int			fd, rcvbuf = 1024 * 1024;
+	char			buf[SAMPLE_BUF_SIZE], cpumask[32];
+	struct nlmsghdr		*hdr = (struct nlmsghdr *)buf;
+	struct nlattr		*nla;
+	ssize_t			len;
+
+	assert(res_family);
+
+	/* the requests are answered synchronously, it only becomes nonblocking for the draining */
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd == -1)
+		return -1;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) == -1)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+		goto _err;
+
+	/* look up the taskstats family */
+	if (genl_send(fd, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME, sizeof(TASKSTATS_GENL_NAME)) == -1)
+		goto _err;
+
+	len = recv(fd, buf, sizeof(buf), 0);
+	if (len == -1 || !NLMSG_OK(hdr, len) || hdr->nlmsg_type != GENL_ID_CTRL)
+		goto _err; /* NLMSG_ERROR, no taskstats */
+
+	nla = nla_find((char *)NLMSG_DATA(hdr) + GENL_HDRLEN, hdr->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), CTRL_ATTR_FAMILY_ID);
+	if (!nla)
+		goto _err;
+
+	*res_family = *(uint16_t *)((char *)nla + NLA_HDRLEN);
+
+	/* listen on every cpu there could be, the kernel clamps it to the possible ones */
+	snprintf(cpumask, sizeof(cpumask), "0-%li", sysconf(_SC_NPROCESSORS_CONF) - 1);
+	if (genl_send(fd, *res_family, NLM_F_ACK, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpumask, strlen(cpumask) + 1) == -1)
+		goto _err;
+
+	len = recv(fd, buf, sizeof(buf), 0);
+	if (len == -1 || !NLMSG_OK(hdr, len) || hdr->nlmsg_type != NLMSG_ERROR || ((struct nlmsgerr *)NLMSG_DATA(hdr))->error)
+		goto _err;
+
+	/* closing the socket is all it takes to stop the notifications, the kernel drops listeners it can't deliver to */
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		goto _err;
+
+	return fd;
+
+_err:
+	close(fd);
+
+	return -1;
+}
+
+
+/* sum an exited task's totals into proc's exit store, final when the task was all that remained of proc, etime_us is proc's lifetime then */
+static void taskstats_account(vmon_t *vmon, vmon_proc_t *proc, struct taskstats *ts, int final, unsigned long long etime_us)
+{
+	int			wants = proc->wants ? proc->wants : vmon->proc_wants;
+	vmon_proc_exit_t	*store;
+
+	if (!(wants & VMON_WANT_PROC_EXIT))
+		return;
+
+	/* the exit may precede the first sample, the store's implicit ctor has nothing to add */
+	if (!proc->stores[VMON_STORE_PROC_EXIT] && !(proc->stores[VMON_STORE_PROC_EXIT] = slab_alloc(vmon, sizeof(vmon_proc_exit_t))))
+		return;
+
+	store = proc->stores[VMON_STORE_PROC_EXIT];
+	if (!store->reported) {
+		memset(store->changed, 0, sizeof(store->changed));
+		store->reported = 1;
+	}
+
+#define exit_sum(_member, _sym, _val)					\
+	if ((_val)) {							\
+		store->_member += (_val);				\
+		BITSET(store->changed, VMON_ ## _sym);			\
+	}
+
+#define exit_max(_member, _sym, _val)					\
+	if ((_val) > store->_member) {					\
+		store->_member = (_val);				\
+		BITSET(store->changed, VMON_ ## _sym);			\
+	}
+
+	exit_sum(utime_us, PROC_EXIT_UTIME, ts->ac_utime);
+	exit_sum(stime_us, PROC_EXIT_STIME, ts->ac_stime);
+	exit_sum(minflt, PROC_EXIT_MINFLT, ts->ac_minflt);
+	exit_sum(majflt, PROC_EXIT_MAJFLT, ts->ac_majflt);
+	exit_sum(nvcsw, PROC_EXIT_NVCSW, ts->nvcsw);
+	exit_sum(nivcsw, PROC_EXIT_NIVCSW, ts->nivcsw);
+	exit_sum(rchars, PROC_EXIT_RCHAR, ts->read_char);
+	exit_sum(wchars, PROC_EXIT_WCHAR, ts->write_char);
+	exit_sum(syscr, PROC_EXIT_SYSCR, ts->read_syscalls);
+	exit_sum(syscw, PROC_EXIT_SYSCW, ts->write_syscalls);
+	exit_sum(read_bytes, PROC_EXIT_READBYTES, ts->read_bytes);
+	exit_sum(write_bytes, PROC_EXIT_WRITEBYTES, ts->write_bytes);
+	exit_sum(cancelled_write_bytes, PROC_EXIT_CANCELLED_WRITEBYTES, ts->cancelled_write_bytes);
+	exit_max(hiwater_rss, PROC_EXIT_HIWATER_RSS, ts->hiwater_rss);
+	exit_max(hiwater_vm, PROC_EXIT_HIWATER_VM, ts->hiwater_vm);
+
+#undef exit_sum
+#undef exit_max
+
+	store->tasks++;
+
+	if (final) {
+		store->exit_code = ts->ac_exitcode;
+		BITSET(store->changed, VMON_PROC_EXIT_CODE);
+		store->etime_us = etime_us;
+		BITSET(store->changed, VMON_PROC_EXIT_ETIME);
+		store->exited = 1;
+	}
+}
+
+
+/* consume the queued taskstats exit notifications, called at the start of every sample after the proc connector events */
+static void taskstats_drain(vmon_t *vmon)
+{
+	struct sockaddr_nl	addr;
+	socklen_t		addrlen;
+	ssize_t			len;
+	char			*buf;
+
+	assert(vmon);
+
+	buf = sample_buf(vmon, SAMPLE_BUF_SIZE);
+	if (!buf)
+		return;
+
+	for (;;) {
+		struct nlmsghdr	*hdr;
+
+		addrlen = sizeof(addr);
+		len = recvfrom(vmon->taskstats_fd, buf, SAMPLE_BUF_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+		if (len == -1) {
+			if (errno == EINTR || errno == ENOBUFS)
+				continue; /* lost notifications just leave those exits without their totals */
+
+			break; /* EAGAIN, drained */
+		}
+
+		if (addr.nl_pid != 0) /* only the kernel gets to tell us about processes */
+			continue;
+
+		for (hdr = (struct nlmsghdr *)buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+			struct genlmsghdr	*genl = NLMSG_DATA(hdr);
+			struct taskstats	ts = {};
+			struct nlattr		*aggr, *stats;
+			vmon_proc_t		*proc;
+			size_t			n;
+
+			if (hdr->nlmsg_type != vmon->taskstats_family || hdr->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN) || genl->cmd != TASKSTATS_CMD_NEW)
+				continue;
+
+			/* the per-task totals, an accompanying TASKSTATS_TYPE_AGGR_TGID only carries the group's delay accounting */
+			aggr = nla_find((char *)genl + GENL_HDRLEN, hdr->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), TASKSTATS_TYPE_AGGR_PID);
+			if (!aggr)
+				continue;
+
+			stats = nla_find((char *)aggr + NLA_HDRLEN, aggr->nla_len - NLA_HDRLEN, TASKSTATS_TYPE_STATS);
+			if (!stats)
+				continue;
+
+			/* the kernel's struct may be a newer version than ours, and the payload isn't aligned for direct access */
+			n = stats->nla_len - NLA_HDRLEN;
+			memcpy(&ts, (char *)stats + NLA_HDRLEN, n < sizeof(ts) ? n : sizeof(ts));
+			if (ts.version < 12)
+				continue; /* no ac_tgid or AGROUP to go by */
+
+			/* threads monitored as such get their own totals */
+			if ((proc = vmon_proc_lookup(vmon, ts.ac_pid, 1)))
+				taskstats_account(vmon, proc, &ts, 1, ts.ac_etime);
+
+			/* the process gets all of its tasks summed, this misses any which exited before we were listening */
+			if ((proc = vmon_proc_lookup(vmon, ts.ac_tgid, 0)))
+				taskstats_account(vmon, proc, &ts, !!(ts.ac_flag & AGROUP), ts.ac_tgetime);
+		}
+	}
+}
+
+
+/* VMON_FLAG_PPID_HIERARCHY support.
+ * Instead of reading the children file of every process following children, /proc is scanned once per sample and any unmonitored
+ * process found whose parent is following children gets monitored as its child.  The scan is merged against the previous one,
+ * which remembers the parent of every pid left unmonitored, so stat is only read for pids new to the scan, those whose parent
+ * has since disappeared (reparented orphans), and a rotating 1/PPID_REVALIDATE_INTERVAL of the rest to catch pids reused
+ * between samples.  Monitored processes missing from the scan get flagged as exited just like the proc connector does, leaving
+ * the staleness to proc_follow_children().
+ *
+ * The scan always covers all of /proc no matter how small the monitored hierarchies are, so this only pays off when they're
+ * large, e.g. rooted at PID 1 or with VMON_FLAG_PROC_ALL.  For a few small subtrees reading their children files is cheaper.
+ */
+#define PPID_REVALIDATE_INTERVAL	16
+#define PPID_UNKNOWN			-1	/* the pid was monitored or unreadable, its parent isn't known */
+
+typedef struct _ppid_t {
+	int	pid;
+	int	ppid;
+} ppid_t;
+
+struct _vmon_ppids_t {
+	ppid_t	*prev;		/* the previous scan, in ascending pid order */
+	ppid_t	*next;		/* the scan being built, swapped with prev once complete */
+	int	prev_nr;
+	int	size;		/* allocated size of both prev and next */
+	ppid_t	*adopt;		/* live processes still monitored under an exited parent this scan, see ppid_adopt() */
+	int	adopt_nr;
+	int	adopt_size;
+};
+
+
+static void ppids_destroy(struct _vmon_ppids_t *ppids)
+{
+	if (!ppids)
+		return;
+
+	try_free((void **)&ppids->prev);
+	try_free((void **)&ppids->next);
+	try_free((void **)&ppids->adopt);
+	free(ppids);
+}
+
+
+/* read pid's parent from its stat, returns PPID_UNKNOWN if it's gone */
+static int ppid_read(vmon_t *vmon, int pid)
+{
+	char	buf[256], *p;
+	ssize_t	len;
+	int	fd, ppid = 0;
+
+	fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/stat", pid);
+	if (fd == -1)
+		return PPID_UNKNOWN;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	close(fd);
+	if (len <= 0)
+		return PPID_UNKNOWN;
+
+	buf[len] = '\0';
+
+	/* "pid (comm) state ppid ...", comm may contain anything so its end is found from the right, nothing after it has a ')' */
+	p = strrchr(buf, ')');
+	if (!p || p[1] != ' ' || !p[2] || p[3] != ' ')
+		return PPID_UNKNOWN;
+
+	for (p += 4; *p >= '0' && *p <= '9'; p++)
+		ppid = ppid * 10 + (*p - '0');
+
+	return ppid;
+}
+
+
+/* monitor pid as a child of ppid if that's a process following children, returns 1 if pid got monitored */
+static int ppid_attach(vmon_t *vmon, int pid, int ppid)
+{
+	vmon_proc_t	*parent;
+
+	parent = vmon_proc_lookup(vmon, ppid, 0);
+	if (!parent || parent->is_stale || parent->exited || !(parent->wants & VMON_WANT_PROC_FOLLOW_CHILDREN))
+		return 0;
+
+	return !!proc_monitor(vmon, parent, pid, parent->wants, NULL, NULL);
+}
+
+
+/* Orphans are still monitored as stale under their exited parent when the scan finds them, and only get unmonitored further
+ * into the sample, so the scan can't attach them to their new parent.  They're left for the new parent's
+ * proc_follow_children() to adopt once it has unmonitored its stale children, same as when reading its children file.
+ */
+static void ppid_adopt(vmon_t *vmon, vmon_proc_t *parent)
+{
+	struct _vmon_ppids_t	*ppids = vmon->ppids;
+	int			i;
+
+	for (i = 0; i < ppids->adopt_nr; i++) {
+		if (ppids->adopt[i].ppid == parent->pid && !vmon_proc_lookup(vmon, ppids->adopt[i].pid, 0))
+			proc_monitor(vmon, parent, ppids->adopt[i].pid, parent->wants, NULL, NULL);
+	}
+}
+
+
+/* flag pid as exited if it's monitored, it's no longer in /proc */
+static void ppid_exited(vmon_t *vmon, int pid)
+{
+	vmon_proc_t	*proc;
+
+	if ((proc = vmon_proc_lookup(vmon, pid, 0)))
+		proc->exited = 1;
+}
+
+
+/* scan /proc bringing the children of the processes following them up to date */
+static void ppid_scan(vmon_t *vmon)
+{
+	struct _vmon_ppids_t	*ppids = vmon->ppids;
+	ppid_t			*tmp;
+	int			n, i, j, attached = 0, deferred = 0;
+
+	n = scan_pids(vmon, vmon->proc_dir);
+	if (n < 0)
+		return;
+
+	if (n > ppids->size) {
+		int	new_size = ppids->size ? ppids->size : SCAN_BUF_SIZE / SCAN_DIRENT_MIN;
+
+		while (new_size < n)
+			new_size <<= 1;
+
+		if (!(tmp = realloc(ppids->prev, new_size * sizeof(ppid_t))))
+			return;
+
+		ppids->prev = tmp;
+
+		if (!(tmp = realloc(ppids->next, new_size * sizeof(ppid_t))))
+			return;
+
+		ppids->next = tmp;
+		ppids->size = new_size;
+	}
+
+	ppids->adopt_nr = 0;
+	for (i = 0, j = 0; i < n; i++) {
+		int		pid = vmon->scan_pids[i], ppid = PPID_UNKNOWN;
+		vmon_proc_t	*proc;
+
+		for (; j < ppids->prev_nr && ppids->prev[j].pid < pid; j++)
+			ppid_exited(vmon, ppids->prev[j].pid);
+
+		if (j < ppids->prev_nr && ppids->prev[j].pid == pid)
+			ppid = ppids->prev[j++].ppid;
+
+		if ((proc = vmon_proc_lookup(vmon, pid, 0))) {
+			/* already in the hierarchy, nothing to do unless it's alive but going stale with its parent */
+			ppid = PPID_UNKNOWN;
+
+			if (proc->is_stale && !proc->exited && proc->parent && (ppid = ppid_read(vmon, pid)) > 0 && ppid != proc->parent->pid &&
+			    scan_reserve((void **)&ppids->adopt, &ppids->adopt_size, ppids->adopt_nr + 1, sizeof(ppid_t)) == 0)
+				ppids->adopt[ppids->adopt_nr++] = (ppid_t){ pid, ppid };
+
+			ppid = PPID_UNKNOWN;
+		} else {
+			/* init and kthreadd have ppid 0, which is never in the scan but is as known a parent as any */
+			if (ppid == PPID_UNKNOWN ||
+			    (pid + vmon->generation) % PPID_REVALIDATE_INTERVAL == 0 ||
+			    (ppid != 0 && !bsearch(&ppid, vmon->scan_pids, n, sizeof(int), scan_pids_cmp)))
+				ppid = ppid_read(vmon, pid);
+
+			if (ppid > 0 && ppid_attach(vmon, pid, ppid)) {
+				ppid = PPID_UNKNOWN;
+				attached++;
+			} else if (ppid > pid) {
+				deferred++; /* its parent is further on, and may yet get attached itself */
+			}
+		}
+
+		ppids->next[i] = (ppid_t){ pid, ppid };
+	}
+
+	for (; j < ppids->prev_nr; j++)
+		ppid_exited(vmon, ppids->prev[j].pid);
+
+	/* pids are reused, so parents aren't always found before their children, keep going while that leaves more to attach */
+	while (deferred && attached) {
+		attached = 0;
+		for (i = 0; i < n; i++) {
+			if (ppids->next[i].ppid > 0 && ppid_attach(vmon, ppids->next[i].pid, ppids->next[i].ppid)) {
+				ppids->next[i].ppid = PPID_UNKNOWN;
+				attached++;
+			}
+		}
+	}
+
+	tmp = ppids->prev;
+	ppids->prev = ppids->next;
+	ppids->next = tmp;
+	ppids->prev_nr = n;
 }
 
 
@@ -476,9 +2721,10 @@ static vmon_proc_t * proc_monitor(vmon_t *vmon, vmon_proc_t *parent, int pid, vm
 static int proc_follow_children(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follow_children_t **store)
 {
 	int		changes = 0;
-	int		len, total = 0, i, child_pid = 0, found;
+	int		len = 0, i, j, n = 0, nr, child_pid = 0, found;
+	char		*buf;
+	int		rescan = read_children_files(vmon);
 	vmon_proc_t	*tmp, *_tmp;
-	list_head_t	*cur, *start;
 
 	assert(vmon);
 	assert(store);
@@ -490,9 +2736,13 @@ static int proc_follow_children(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follo
 	}
 
 	if (!(*store)) { /* implicit ctor on first sample */
-		*store = calloc(1, sizeof(vmon_proc_follow_children_t));
+		*store = slab_alloc(vmon, sizeof(vmon_proc_follow_children_t));
 
-		(*store)->children_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/children", proc->pid, proc->pid);
+		(*store)->children_fd = -1;
+		if (!vmon->ppids) { /* the ppid scan has no use for the children file */
+			(*store)->children_fd = proc_openf(vmon, proc, 1, "children");
+			rescan = 1;
+		}
 	}
 
 	/* unmonitor stale children on entry, this concludes the two-phase removal of a process */
@@ -508,55 +2758,41 @@ static int proc_follow_children(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follo
 		return SAMPLE_CHANGED;
 	}
 
+	if (vmon->ppids)
+		ppid_adopt(vmon, proc);
+
+	if (!rescan) {
+		/* the proc connector or ppid scan has already monitored any new children, just carry forward those it hasn't reported exiting */
+		list_for_each_entry(tmp, &proc->children, siblings) {
+			if (tmp->exited || tmp->generation == vmon->generation)
+				continue;
+
+			tmp->generation = vmon->generation;
+			tmp->is_new = 0;
+		}
+	}
+
 	/* maintain our awareness of children, if we detect a new child initiate monitoring for it, existing children get their generation number updated */
-	start = &proc->children;
-	while ((len = try_pread((*store)->children_fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		total += len;
+	if (rescan && (len = read_records(vmon, (*store)->children_fd, &(*store)->children_size, &buf)) > 0) {
+		int	sorted = 1, last = -1;
+
+		if (scan_reserve((void **)&vmon->scan_pids, &vmon->scan_pids_size, len / 2, sizeof(int)) < 0)
+			return SAMPLE_ERROR; /* rather than find every child stale */
 
+		/* the children file is a list of space-terminated pids in the order the kernel keeps them, which is fork order
+		 * with any adopted orphans at the end, collect them into a sorted array */
 		for (i = 0; i < len; i++) {
-			switch (vmon->buf[i]) {
+			switch (buf[i]) {
 				case '0' ... '9':
 					/* PID component, accumulate it */
 					child_pid *= 10;
-					child_pid += (vmon->buf[i] - '0');
+					child_pid += (buf[i] - '0');
 					break;
 
 				case ' ':
-					/* separator, terminates a PID, search for it in the childrens list */
-					found = 0;
-					list_for_each(cur, start) {
-						if (cur == &proc->children) /* take care to skip the head node */
-							continue;
-
-						if (list_entry(cur, vmon_proc_t, siblings)->pid == child_pid) {
-							/* found the child already monitored, update its generation number and stop searching */
-							tmp = list_entry(cur, vmon_proc_t, siblings);
-							tmp->generation = vmon->generation;
-							found = 1;
-							tmp->is_new = 0;
-							break;
-						}
-					}
-
-					if (found || (tmp = proc_monitor(vmon, proc, child_pid, proc->wants, NULL, NULL))) {
-						/* There's an edge case where vmon_proc_monitor() finds child_pid existing as a child of something else,
-						 * in that case we're effectively migrating it to a new parent.  This occurs in the vmon use case where
-						 * it's monitoring PID1-down, and PID1 of course inherits orphans.  So some descendant proc is already
-						 * being monitored with its children monitored too, but that proc has exited, orphaning its children.
-						 * The kernel has since moved the orphaned children up to be children of PID1, and we could be performing
-						 * children following for PID1 here, discovering those newly inherited orphans whose exited parent hasn't
-						 * even been flagged as is_stale yet in libvmon, let alone been unreffed/removed from the htab.
-						 *
-						 * In such a scenario, we need to _not_ use its siblings node as a search start, because we'll be stepping
-						 * into the other parent's children list, which would be Very Broken.  What we instead do, is basically
-						 * nothing, so it can be handled in a future sample, after the exited parent can go through its is_stale=1
-						 * cycle and unlink itself from the orphaned descendants.  There are more complicated ways to handle this
-						 * which would technically be more accurate, but let's just do the simple and correct thing for now.
-						 */
-						if (tmp->parent == proc)
-							start = &tmp->siblings;
-					} /* else { proc_monitor failed just move on } */
-
+					/* separator, terminates a PID */
+					sorted &= child_pid > last;
+					vmon->scan_pids[n++] = last = child_pid;
 					child_pid = 0;
 					break;
 
@@ -564,6 +2800,66 @@ static int proc_follow_children(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follo
 					assert(0);
 			}
 		}
+
+		if (!sorted)
+			qsort(vmon->scan_pids, n, sizeof(int), scan_pids_cmp);
+
+		/* the children list is ordered the same way with new children inserted in pid order, but the proc connector appends
+		 * the ones it monitors and nodes already on the list are never moved (vwm/charts.c rows follow them), so take a
+		 * sorted snapshot of it to merge against */
+		nr = 0;
+		last = -1;
+		sorted = 1;
+		list_for_each_entry(tmp, &proc->children, siblings) {
+			if (nr == vmon->scan_procs_size && scan_reserve((void **)&vmon->scan_procs, &vmon->scan_procs_size, nr + 1, sizeof(vmon_proc_t *)) < 0)
+				return SAMPLE_ERROR;
+
+			sorted &= tmp->pid > last;
+			vmon->scan_procs[nr++] = tmp;
+			last = tmp->pid;
+		}
+
+		if (!sorted)
+			qsort(vmon->scan_procs, nr, sizeof(vmon_proc_t *), scan_procs_cmp);
+
+		for (i = 0, j = 0; i < n; i++) {
+			child_pid = vmon->scan_pids[i];
+
+			/* children skipped over here keep their old generation number and are found stale below */
+			while (j < nr && vmon->scan_procs[j]->pid < child_pid)
+				j++;
+
+			if (j < nr && vmon->scan_procs[j]->pid == child_pid) {
+				/* found the child already monitored, update its generation number */
+				tmp = vmon->scan_procs[j++];
+
+				/* unless the pid is a new child's, the exited one goes stale and the new one gets found once it's gone */
+				if (tmp->exited && pidfd_reaped(tmp))
+					continue;
+
+				tmp->generation = vmon->generation;
+				tmp->is_new = 0;
+				continue;
+			}
+
+			tmp = proc_monitor(vmon, proc, child_pid, proc->wants, NULL, NULL);
+			/* There's an edge case where vmon_proc_monitor() finds child_pid existing as a child of something else,
+			 * in that case we're effectively migrating it to a new parent.  This occurs in the vmon use case where
+			 * it's monitoring PID1-down, and PID1 of course inherits orphans.  So some descendant proc is already
+			 * being monitored with its children monitored too, but that proc has exited, orphaning its children.
+			 * The kernel has since moved the orphaned children up to be children of PID1, and we could be performing
+			 * children following for PID1 here, discovering those newly inherited orphans whose exited parent hasn't
+			 * even been flagged as is_stale yet in libvmon, let alone been unreffed/removed from the htab.
+			 *
+			 * In such a scenario, we mustn't touch its siblings node, because it's on the other parent's children
+			 * list, which would be Very Broken.  What we instead do, is basically nothing, so it can be handled in a
+			 * future sample, after the exited parent can go through its is_stale=1 cycle and unlink itself from the
+			 * orphaned descendants.  The same goes for a top-level process proc_monitor() just gave a parent, it's
+			 * left for sample_siblings() to migrate.  Only a child created just now lands at the end of our list.
+			 */
+			if (tmp && tmp->parent == proc && proc->children.prev == &tmp->siblings && j < nr)
+				list_move_tail(&tmp->siblings, &vmon->scan_procs[j]->siblings); /* place it before the next child in pid order */
+		}
 	}
 
 	/* look for children which seem to no longer exist (found by stale generation numbers) and queue them for unmonitoring, flag this as a children change too */
@@ -591,10 +2887,9 @@ static int proc_follow_children(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follo
 static int proc_follow_threads(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follow_threads_t **store)
 {
 	int		changes = 0;
-	struct dirent	*dentry;
-	list_head_t	*cur, *start;
+	list_head_t	*cur;
 	vmon_proc_t	*tmp, *_tmp;
-	int		found;
+	int		n, i;
 
 	assert(vmon);
 	assert(store);
@@ -617,11 +2912,9 @@ static int proc_follow_threads(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follow
 		return SAMPLE_UNCHANGED;
 
 	if (!(*store)) { /* implicit ctor on first sample */
-		*store = calloc(1, sizeof(vmon_proc_follow_threads_t));
+		*store = slab_alloc(vmon, sizeof(vmon_proc_follow_threads_t));
 
 		(*store)->task_dir = opendirf(vmon, vmon->proc_dir, "%i/task", proc->pid);
-	} else if ((*store)->task_dir) {
-		seekdir((*store)->task_dir, 0);
 	}
 
 	if (!(*store)->task_dir)
@@ -635,7 +2928,7 @@ static int proc_follow_threads(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follow
 
 	/* If proc is stale, assume all the threads are stale as well.  In vwm/charts.c we assume all descendants of a stale node
 	 * are implicitly stale, so let's ensure that's a consistent assumumption WRT libvmon's maintenance of the hierarchy.
-	 * The readdir below seems like it would't find any threads of a stale process, but maybe there's some potential for a race there,
+	 * The scan below seems like it would't find any threads of a stale process, but maybe there's some potential for a race there,
 	 * particularly since we reuse an open reference on the task_dir.
 	 * This reflects a similar implicit is_stale propagation in follow_children.
 	 */
@@ -649,39 +2942,35 @@ static int proc_follow_threads(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_follow
 		return SAMPLE_UNCHANGED;
 	}
 
-	start = &proc->threads;
-	while ((dentry = readdir((*store)->task_dir))) {
-		int	tid;
-
-		if (dentry->d_name[0] == '.' && (dentry->d_name[1] == '\0' || (dentry->d_name[1] == '.' && dentry->d_name[2] == '\0')))
-			continue; /* skip . and .. */
+	n = scan_pids(vmon, (*store)->task_dir);
+	if (n < 0)
+		return SAMPLE_ERROR;
 
-		tid = atoi(dentry->d_name);
+	/* the threads list is kept in tid order, so the scanned tids merge against it: threads missing from the list get monitored in
+	 * place, threads missing from the scan become stale, and the rest are simply stepped over */
+	cur = proc->threads.next;
+	for (i = 0; i < n; i++) {
+		int	tid = vmon->scan_pids[i];
 
-		found = 0;
-		list_for_each(cur, start) {
-			if (cur == &proc->threads) /* take care to skip the head node */
-				continue;
+		while (cur != &proc->threads && (tmp = list_entry(cur, vmon_proc_t, threads))->pid < tid) {
+			/* set threads not found to stale status so the caller can respond and on our next sample invocation we will unmonitor them */
+			tmp->is_stale = 1;
+			cur = cur->next;
+		}
 
-			if (list_entry(cur, vmon_proc_t, threads)->pid == tid) {
-				/* found the thread already monitored, update its generation number and stop searching */
-				tmp = list_entry(cur, vmon_proc_t, threads);
-				tmp->generation = vmon->generation;
-				found = 1;
-				tmp->is_new = 0;
-				break;
-			}
+		if (cur != &proc->threads && (tmp = list_entry(cur, vmon_proc_t, threads))->pid == tid) {
+			tmp->generation = vmon->generation;
+			tmp->is_new = 0;
+			cur = cur->next;
+			continue;
 		}
 
-		if (found || (tmp = proc_monitor(vmon, proc, tid, (proc->wants | VMON_INTERNAL_PROC_IS_THREAD), NULL, NULL)))
-			start = &tmp->threads;
+		if ((tmp = proc_monitor(vmon, proc, tid, (proc->wants | VMON_INTERNAL_PROC_IS_THREAD), NULL, NULL)))
+			list_move_tail(&tmp->threads, cur);
 	}
 
-	list_for_each_entry_safe(tmp, _tmp, &proc->threads, threads) {
-		/* set children not found to stale status so the caller can respond and on our next sample invocation we will unmonitor them */
-		if (tmp->generation != vmon->generation)
-			tmp->is_stale = 1;
-	}
+	for (; cur != &proc->threads; cur = cur->next)
+		list_entry(cur, vmon_proc_t, threads)->is_stale = 1;
 
 	return changes ? SAMPLE_CHANGED : SAMPLE_UNCHANGED;
 }
@@ -696,9 +2985,11 @@ typedef enum _vmon_proc_stat_fsm_t {
 static sample_ret_t proc_sample_stat(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_stat_t **store)
 {
 	int			changes = 0;
-	int			i, len, total = 0;
-	char			*arg;
-	int			argn, prev_argc;
+	char			*buf;
+	int			i, len;
+	fields_t		_f;
+	int			comm_len = (*store) ? (*store)->comm.len - 1 : 0;
+	int			comm_start, comm_end;
 	vmon_proc_stat_fsm_t	state = VMON_PARSER_STATE_PROC_STAT_PID;
 #define VMON_PREPARE_PARSER
 #include "defs/proc_stat.def"
@@ -707,15 +2998,13 @@ static sample_ret_t proc_sample_stat(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_
 	assert(store);
 
 	if (!proc) { /* dtor */
-		try_close(&(*store)->comm_fd);
-		try_free((void **)&(*store)->comm.array);
+		char_array_release(vmon, &(*store)->comm);
 		try_close(&(*store)->cmdline_fd);
-		try_free((void **)&(*store)->cmdline.array);
-		try_free((void **)&(*store)->argv);
+		char_array_release(vmon, &(*store)->cmdline);
 		try_close(&(*store)->wchan_fd);
-		try_free((void **)&(*store)->wchan.array);
+		char_array_release(vmon, &(*store)->wchan);
 		try_close(&(*store)->stat_fd);
-		try_free((void **)&(*store)->exe.array);
+		char_array_release(vmon, &(*store)->exe);
 
 		return DTOR_FREE;
 	}
@@ -723,19 +3012,11 @@ static sample_ret_t proc_sample_stat(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_
 /* _retry: */
 	if (!(*store)) { /* ctor */
 
-		*store = calloc(1, sizeof(vmon_proc_stat_t));
+		*store = slab_alloc(vmon, sizeof(vmon_proc_stat_t));
 
-		if (proc->is_thread) {
-			(*store)->comm_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/comm", proc->pid, proc->pid);
-			(*store)->cmdline_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/cmdline", proc->pid, proc->pid);
-			(*store)->wchan_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/wchan", proc->pid, proc->pid);
-			(*store)->stat_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/stat", proc->pid, proc->pid);
-		} else {
-			(*store)->comm_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/comm", proc->pid);
-			(*store)->cmdline_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/cmdline", proc->pid);
-			(*store)->wchan_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/wchan", proc->pid);
-			(*store)->stat_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/stat", proc->pid);
-		}
+		(*store)->cmdline_fd = proc_openf(vmon, proc, 0, "cmdline");
+		(*store)->wchan_fd = proc_openf(vmon, proc, 0, "wchan");
+		(*store)->stat_fd = proc_openf(vmon, proc, 0, "stat");
 
 		/* initially everything is considered changed */
 		memset((*store)->changed, 0xff, sizeof((*store)->changed));
@@ -744,60 +3025,81 @@ static sample_ret_t proc_sample_stat(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_
 		memset((*store)->changed, 0, sizeof((*store)->changed));
 	}
 
-	/* XXX TODO: integrate load_contents_fd() calls into changes++ maintenance */
-	/* /proc/$pid/comm */
-	load_contents_fd(vmon, &(*store)->comm, (*store)->comm_fd, LOAD_FLAGS_NOTRUNCATE, (*store)->changed, VMON_PROC_STAT_COMM);
-
-	/* /proc/$pid/cmdline */
-	load_contents_fd(vmon, &(*store)->cmdline, (*store)->cmdline_fd, LOAD_FLAGS_NOTRUNCATE, (*store)->changed, VMON_PROC_STAT_CMDLINE);
-	for (prev_argc = (*store)->argc, (*store)->argc = 0, i = 0; i < (*store)->cmdline.len; i++) {
-		if (!(*store)->cmdline.array[i])
-			(*store)->argc++;
-	}
-
-	/* if the cmdline has changed, allocate argv array and store ptrs to the fields within it */
-	if (BITTEST((*store)->changed, VMON_PROC_STAT_CMDLINE)) {
-		if (prev_argc != (*store)->argc) {
-			try_free((void **)&(*store)->argv); /* XXX could realloc */
-			(*store)->argv = calloc(1, (*store)->argc * sizeof(char *));
+	/* read in stat and parse it assigning the stat members accordingly, the comm within it is taken verbatim */
+	if ((len = read_contents(vmon, (*store)->stat_fd, &(*store)->stat_size, &buf)) > 0) {
+		/* comm may contain anything including parens, so it spans from the first '(' to the last ')' */
+		for (comm_start = 0; comm_start < len && buf[comm_start] != '('; comm_start++);
+		for (comm_end = len - 1; comm_end > comm_start && buf[comm_end] != ')'; comm_end--);
+
+		if (comm_end > comm_start) {
+			/* store it like /proc/$pid/comm presents it, newline terminated, which the closing paren briefly becomes */
+			comm_len = comm_end - comm_start - 1;
+			buf[comm_end] = '\n';
+			char_array_set(vmon, &(*store)->comm, &buf[comm_start + 1], comm_len + 1, (*store)->changed, VMON_PROC_STAT_COMM);
+			buf[comm_end] = ')';
 		}
 
-		for (argn = 0, arg = (*store)->cmdline.array, i = 0; i < (*store)->cmdline.len; i++) {
-			if (!(*store)->cmdline.array[i]) {
-				(*store)->argv[argn++] = arg;
-				arg = &(*store)->cmdline.array[i + 1];
+		if (fields_init(&_f, buf, len)) {
+			switch (state) {
+#define VMON_IMPLEMENT_FIELDS_PARSER
+#include "defs/proc_stat.def"
 			}
-		}
-	}
 
-	/* /proc/$pid/wchan */
-	load_contents_fd(vmon, &(*store)->wchan, (*store)->wchan_fd, LOAD_FLAGS_NOTRUNCATE, (*store)->changed, VMON_PROC_STAT_WCHAN);
-
-	/* /proc/$pid/exe */
-	if ((*store)->cmdline.len) /* kernel threads have no cmdline, and always fail readlinkf() on exe, skip readlinking the exe for them using this heuristic */
-		readlinkf(vmon, &(*store)->exe, vmon->proc_dir, "%i/exe", proc->pid);
-
-	/* XXX TODO: there's a race between discovering comm_len from /proc/$pid/comm and applying it in the parsing of /proc/$pid/stat, detect the race
-	 * scenario and retry the sample when detected by goto _retry (see commented _retry label above) */
-
-	/* read in stat and parse it assigning the stat members accordingly */
-	while ((len = try_pread((*store)->stat_fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		total += len;
+			goto _parsed;
+		}
 
 		for (i = 0; i < len; i++) {
 			/* parse the fields from the file, stepping through... */
-			_p.input = vmon->buf[i];
+			_p.input = buf[i];
 			switch (state) {
 #define VMON_PARSER_DELIM ' '	/* TODO XXX eliminate the need for this, I want the .def's to include all the data format knowledge */
 #define VMON_IMPLEMENT_PARSER
 #include "defs/proc_stat.def"
 				default:
 					/* we're finished parsing once we've fallen off the end of the symbols */
-					goto _out; /* this saves us the EOF read syscall */
+					goto _parsed;
 			}
 		}
 	}
 
+_parsed:
+	/* /proc/$pid/wchan */
+	load_contents_fd(vmon, &(*store)->wchan, (*store)->wchan_fd, LOAD_FLAGS_NOTRUNCATE, (*store)->changed, VMON_PROC_STAT_WCHAN);
+
+	/* cmdline and exe only change across exec, which also replaces comm and the address space layout, or when explicitly requested via vmon_proc_reload().
+	 * (setproctitle() style argv rewriting goes unnoticed unless it's accompanied by PR_SET_NAME)
+	 * The kernel masks startcode and startstack to constants for processes the caller can't ptrace, so for those (without VMON_FLAG_PROC_EVENTS,
+	 * which needs CAP_NET_ADMIN) only a changed comm is noticed: an exec keeping the same comm leaves cmdline and exe stale. */
+	if (!BITTEST((*store)->changed, VMON_PROC_STAT_COMM) &&
+	    !BITTEST((*store)->changed, VMON_PROC_STAT_STARTCODE) &&
+	    !BITTEST((*store)->changed, VMON_PROC_STAT_STARTSTACK) &&
+	    !proc->reload)
+		goto _out;
+
+	proc->reload = 0;
+
+	/* XXX TODO: integrate load_contents_fd() calls into changes++ maintenance */
+	/* /proc/$pid/cmdline */
+	load_contents_fd(vmon, &(*store)->cmdline, (*store)->cmdline_fd, LOAD_FLAGS_NOTRUNCATE, (*store)->changed, VMON_PROC_STAT_CMDLINE);
+
+	/* if the cmdline has changed, take the argv shared with everything else having the same cmdline */
+	if (BITTEST((*store)->changed, VMON_PROC_STAT_CMDLINE)) {
+		(*store)->argc = 0;
+		(*store)->argv = NULL;
+
+		if ((*store)->cmdline.array) {
+			vmon_str_t	*cmdline = str_of((*store)->cmdline.array);
+
+			str_argv(vmon, cmdline);
+			(*store)->argc = cmdline->argc;
+			(*store)->argv = cmdline->argv;
+		}
+	}
+
+	/* /proc/$pid/exe */
+	if ((*store)->cmdline.len) /* kernel threads have no cmdline, and always fail readlinkf() on exe, skip readlinking the exe for them using this heuristic */
+		readlinkf_str(vmon, &(*store)->exe, (*store)->changed, VMON_PROC_STAT_EXE, vmon->proc_dir, "%i/exe", proc->pid);
+
 _out:
 	return changes ? SAMPLE_CHANGED : SAMPLE_UNCHANGED;
 }
@@ -806,44 +3108,125 @@ _out:
 
 
 /* helper for maintaining reference counted global objects table */
+#define FOBJECTS_BITS_MIN	6
+
+/* fobjects hash table helpers, chained on vmon_fobject_t.bucket using a multiplicative hash of the inum */
+static inline unsigned fobjects_bucket(vmon_fobjects_t *table, uint64_t inum)
+{
+	return (inum * 0x9e3779b97f4a7c15ULL) >> (64 - table->bits);
+}
+
+
+/* add fobject to its type's table, growing the table to keep the chains about one entry long */
+static int fobjects_insert(vmon_t *vmon, vmon_fobject_t *fobject)
+{
+	vmon_fobjects_t	*table = &vmon->fobjects[fobject->type];
+
+	if (!table->buckets || table->nr >= (1 << table->bits)) {
+		list_head_t	*old = table->buckets, *buckets;
+		int		old_bits = table->bits, bits = table->buckets ? table->bits + 1 : FOBJECTS_BITS_MIN;
+		int		i;
+
+		buckets = malloc(sizeof(list_head_t) << bits);
+		if (!buckets) {
+			if (!old)
+				return -ENOMEM;
+
+			goto _insert; /* keep using the current table, the chains just get longer */
+		}
+
+		for (i = 0; i < (1 << bits); i++)
+			INIT_LIST_HEAD(&buckets[i]);
+
+		table->buckets = buckets;
+		table->bits = bits;
+
+		if (old) {
+			for (i = 0; i < (1 << old_bits); i++) {
+				vmon_fobject_t	*tmp, *_tmp;
+
+				list_for_each_entry_safe(tmp, _tmp, &old[i], bucket)
+					list_move_tail(&tmp->bucket, &buckets[fobjects_bucket(table, tmp->inum)]);
+			}
+
+			free(old);
+		}
+	}
+
+_insert:
+	list_add_tail(&fobject->bucket, &table->buckets[fobjects_bucket(table, fobject->inum)]);
+	table->nr++;
+	vmon->fobjects_nr++;
+
+	return 0;
+}
+
+
+/* remove fobject from its type's table */
+static void fobjects_remove(vmon_t *vmon, vmon_fobject_t *fobject)
+{
+	list_del(&fobject->bucket);
+	vmon->fobjects[fobject->type].nr--;
+	vmon->fobjects_nr--;
+}
+
+
 static vmon_fobject_t * fobject_lookup_hinted(vmon_t *vmon, const char *path, vmon_fobject_t *hint)
 {
-	vmon_fobject_t	*fobject = NULL, *tmp = NULL;
-	uint64_t	inum;
+	vmon_fobject_t		*fobject = NULL, *tmp = NULL;
+	vmon_fobject_type_t	type;
+	vmon_fobjects_t		*table;
+	const char		*inum_str;
+	uint64_t		inum;
 
 	assert(vmon);
 
-	/* TODO maintain the fobject hash tables, they should probably be isolated/scoped based on the string before the : */
 	/* in reality there needs to be a list somewhere of the  valid prefixes we wish to support, and that list should associate
 	 * the prefixes with the kind of contextual information details we monitor for each of those types.  Then when new
 	 * fobject types are added to libvmon, the rest of the code automatically reflects the additions due to the mechanization.
 	 */
-	if (!path || strncmp(path, "pipe:", 5))
-		return NULL; /* XXX TODO: for now we're only dealing with pipes */
+	if (!path)
+		return NULL;
 
-	sscanf(&path[6], "%" SCNu64 "]", &inum);
+	if (!strncmp(path, "pipe:[", 6)) {
+		type = VMON_FOBJECT_TYPE_PIPE;
+		inum_str = &path[6];
+	} else if (!strncmp(path, "socket:[", 8)) {
+		type = VMON_FOBJECT_TYPE_SOCKET;
+		inum_str = &path[8];
+	} else {
+		return NULL; /* XXX TODO: for now we're only dealing with pipes and sockets, anon_inode:'s have no distinguishing inum */
+	}
 
-	if (hint && hint->inum == inum)
+	inum = strtoull(inum_str, NULL, 10);
+
+	if (hint && hint->type == type && hint->inum == inum)
 		return hint; /* the hint matches, skip the search */
 
-	/* search for the inode, if we can't find it, allocate a new fobject XXX this needs optimizing but silly until we have all object types handled... */
-	list_for_each_entry(tmp, &vmon->fobjects, bucket) {
-		if (tmp->inum == inum) {
-			fobject = tmp;
-			break;
+	/* search for the inode, if we can't find it, allocate a new fobject */
+	table = &vmon->fobjects[type];
+	if (table->buckets) {
+		list_for_each_entry(tmp, &table->buckets[fobjects_bucket(table, inum)], bucket) {
+			if (tmp->inum == inum) {
+				fobject = tmp;
+				break;
+			}
 		}
 	}
 
 	if (!fobject) {
 		/* create a new fobject */
-		fobject = calloc(1, sizeof(vmon_fobject_t));
+		fobject = slab_alloc(vmon, sizeof(vmon_fobject_t));
+		if (!fobject)
+			return NULL;
 
-		fobject->type = VMON_FOBJECT_TYPE_PIPE;
+		fobject->type = type;
 		fobject->inum = inum;
 		INIT_LIST_HEAD(&fobject->ref_fds);
-		INIT_LIST_HEAD(&fobject->bucket);
-		list_add_tail(&fobject->bucket, &vmon->fobjects);
-		vmon->fobjects_nr++;
+		if (fobjects_insert(vmon, fobject) < 0) {
+			slab_free(vmon, fobject);
+			return NULL;
+		}
 
 		if (vmon->fobject_ctor_cb)
 			vmon->fobject_ctor_cb(vmon, fobject);
@@ -879,13 +3262,12 @@ static int fobject_unref(vmon_t *vmon, vmon_fobject_t *fobject, vmon_proc_fd_t *
 
 	if (!fobject->refcnt) {
 		/* after the refcnt drops to zero we discard the fobject */
-		list_del(&fobject->bucket);
-		vmon->fobjects_nr--;
+		fobjects_remove(vmon, fobject);
 
 		if (vmon->fobject_dtor_cb)
 			vmon->fobject_dtor_cb(vmon, fobject);
 
-		free(fobject);
+		slab_free(vmon, fobject);
 		return 1;
 	}
 
@@ -902,20 +3284,22 @@ static void del_fd(vmon_t *vmon, vmon_proc_fd_t *fd)
 	list_del(&fd->fds);
 	if (fd->object)
 		fobject_unref(vmon, fd->object, fd); /* note we supply both the fobject ptr and proc_fd ptr (fd) */
-	try_free((void **)&fd->object_path.array);
-	free(fd);
+	try_slab_free(vmon, (void **)&fd->object_path.array);
+	slab_free(vmon, fd);
 }
 
 
+#define FILES_REVALIDATE_INTERVAL	16	/* samples between full passes over an unchanging looking fd table */
+
 /* implements the open file descriptors (/proc/$pid/fd/...) sampling */
 static sample_ret_t proc_sample_files(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_files_t **store)
 {
 	int		changes = 0;
-	struct dirent	*dentry;
-	int		fdnum;
-	list_head_t	*cur, *start;
+	int		fdnum, n, i;
+	list_head_t	*cur;
 	vmon_proc_fd_t	*fd, *_fd;
 	vmon_fobject_t	*cur_object = NULL;
+	int		revalidate;
 
 	assert(vmon);
 	assert(store);
@@ -943,15 +3327,12 @@ static sample_ret_t proc_sample_files(vmon_t *vmon, vmon_proc_t *proc, vmon_proc
 	}
 
 	if (!(*store)) { /* implicit ctor on first sample */
-		*store = calloc(1, sizeof(vmon_proc_files_t));
+		*store = slab_alloc(vmon, sizeof(vmon_proc_files_t));
 
 		(*store)->refcnt = 1;
 		(*store)->fd_dir = opendirf(vmon, vmon->proc_dir, "%i/fd", proc->pid);
 
 		INIT_LIST_HEAD(&(*store)->fds);
-	} else if ((*store)->fd_dir) {
-		/* we have a directory handle, and we're reentering the function with the directory positioned at the end */
-		seekdir((*store)->fd_dir, 0);
 	}
 
 	if (!(*store)->fd_dir)
@@ -960,44 +3341,50 @@ static sample_ret_t proc_sample_files(vmon_t *vmon, vmon_proc_t *proc, vmon_proc
 		 * make any attempt to ever reopen the directory because the ctor has already run. */
 		goto _fail;
 
-	start = &(*store)->fds;
-	while ((dentry = readdir((*store)->fd_dir))) {
-		if (dentry->d_name[0] == '.' && (dentry->d_name[1] == '\0' || (dentry->d_name[1] == '.' && dentry->d_name[2] == '\0')))
-			continue; /* skip . and .. */
+	/* The fd numbers are read with a single getdents64 pass and merged with the fds list, only fds new to the list get readlinked.
+	 * That leaves an fd being replaced under the same number (dup2(), close+open reusing it) unnoticed, so every
+	 * FILES_REVALIDATE_INTERVAL samples every fd is readlinked regardless. */
+	if ((*store)->revalidate_countdown > 0)
+		(*store)->revalidate_countdown--;
 
-		fdnum = atoi(dentry->d_name);
+	revalidate = !(*store)->revalidate_countdown;
+	if (revalidate)
+		(*store)->revalidate_countdown = FILES_REVALIDATE_INTERVAL;
 
-		/* search the process' files list for this fdnum */
-		fd = NULL;
-		list_for_each(cur, start) {
-			if (cur == &(*store)->fds)
-				continue; /* skip the head node as it's not boxed */
+	n = scan_pids(vmon, (*store)->fd_dir);
+	if (n < 0)
+		goto _fail;
 
-			if (list_entry(cur, vmon_proc_fd_t, fds)->fdnum == fdnum) {
-				fd = list_entry(cur, vmon_proc_fd_t, fds);
-				break;
-			}
-		}
+	/* both are in ascending order: list entries passed over were closed and get swept below, numbers without a matching entry
+	 * are new and get inserted in place. */
+	cur = (*store)->fds.next;
+	for (i = 0; i < n; i++) {
+		fdnum = vmon->scan_pids[i];
 
-		if (!fd) {
-			fd = calloc(1, sizeof(vmon_proc_fd_t));
+		while (cur != &(*store)->fds && list_entry(cur, vmon_proc_fd_t, fds)->fdnum < fdnum)
+			cur = cur->next;
+
+		if (cur != &(*store)->fds && list_entry(cur, vmon_proc_fd_t, fds)->fdnum == fdnum) {
+			fd = list_entry(cur, vmon_proc_fd_t, fds);
+			cur = cur->next;
+		} else {
+			fd = slab_alloc(vmon, sizeof(vmon_proc_fd_t));
 			if (!fd)
 				goto _fail; /* TODO: errors */
 
 			fd->fdnum = fdnum;
 			fd->process = proc;
 			INIT_LIST_HEAD(&fd->ref_fds);
-			list_add_tail(&fd->fds, start);
-		} else {
-			list_move_tail(&fd->fds, start);
+			list_add_tail(&fd->fds, cur);
 		}
 
 		fd->generation = vmon->generation;
 
-		/* Always readlink the fd path, since we have no way of knowing if it's a repurposed fdnum even when we've found a match.
-		 * It would be nice if say.. the mtime of the /proc/$pid/fd directory changed if there's been any fd activity so we could skip the entire
-		 * readdir+readlink loop in idle times, worth investigating. */
-		readlinkf(vmon, &fd->object_path, vmon->proc_dir, "%i/fd/%s", proc->pid, dentry->d_name);
+		/* An existing fdnum is assumed to still refer to the same object, only new fds are readlinked outside of revalidation. */
+		if (fd->object_path.len && !revalidate)
+			continue;
+
+		readlinkf(vmon, &fd->object_path, vmon->proc_dir, "%i/fd/%i", proc->pid, fdnum);
 
 		cur_object = fd->object; /* stow the current object reference before we potentially replace it so we may unreference it if needed  */
 		fd->object = fobject_lookup_hinted(vmon, fd->object_path.array, cur_object);
@@ -1008,16 +3395,12 @@ static sample_ret_t proc_sample_files(vmon_t *vmon, vmon_proc_t *proc, vmon_proc
 			if (fd->object)
 				fobject_ref(vmon, fd->object, fd);
 		} /* else { lookup returned the same object as before (or NULL), is there anything to do? } */
-
-		start = &fd->fds; /* update the search start to this fd */
 	}
 
 	/* search for stale (closed) fds, remove references for any we find */
 	list_for_each_entry_safe(fd, _fd, &(*store)->fds, fds) {
-		if (fd->generation == vmon->generation)
-			break;
-
-		del_fd(vmon, fd);
+		if (fd->generation != vmon->generation)
+			del_fd(vmon, fd);
 	}
 
 	return changes ? SAMPLE_CHANGED : SAMPLE_UNCHANGED;
@@ -1035,8 +3418,10 @@ typedef enum _vmon_proc_vm_fsm_t {
 
 static sample_ret_t proc_sample_vm(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_vm_t **store)
 {
-	int			i, len, total = 0;
+	int			i, len;
 	int			changes = 0;
+	char			*buf;
+	fields_t		_f;
 	vmon_proc_vm_fsm_t	state = VMON_PARSER_STATE_PROC_VM_SIZE_PAGES;
 #define VMON_PREPARE_PARSER
 #include "defs/proc_vm.def"
@@ -1051,12 +3436,8 @@ static sample_ret_t proc_sample_vm(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_vm
 	}
 
 	if (!(*store)) { /* ctor */
-		(*store) = calloc(1, sizeof(vmon_proc_vm_t));
-		if (proc->is_thread) {
-			(*store)->statm_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/statm", proc->pid, proc->pid);
-		} else {
-			(*store)->statm_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/statm", proc->pid);
-		}
+		(*store) = slab_alloc(vmon, sizeof(vmon_proc_vm_t));
+		(*store)->statm_fd = proc_openf(vmon, proc, 0, "statm");
 
 		/* initially everything is considered changed */
 		memset((*store)->changed, 0xff, sizeof((*store)->changed));
@@ -1066,18 +3447,25 @@ static sample_ret_t proc_sample_vm(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_vm
 	}
 
 	/* read in statm and parse it assigning the vm members accordingly */
-	while ((len = try_pread((*store)->statm_fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		total += len;
+	if ((len = read_contents(vmon, (*store)->statm_fd, &(*store)->statm_size, &buf)) > 0) {
+		if (fields_init(&_f, buf, len)) {
+			switch (state) {
+#define VMON_IMPLEMENT_FIELDS_PARSER
+#include "defs/proc_vm.def"
+			}
+
+			goto _out;
+		}
 
 		for (i = 0; i < len; i++) {
 			/* parse the fields from the file, stepping through... */
-			_p.input = vmon->buf[i];
+			_p.input = buf[i];
 			switch (state) {
 #define VMON_IMPLEMENT_PARSER
 #include "defs/proc_vm.def"
 				default:
 					/* we're finished parsing once we've fallen off the end of the symbols */
-					goto _out; /* this saves us the EOF read syscall */
+					goto _out;
 			}
 		}
 	}
@@ -1095,8 +3483,9 @@ typedef enum _vmon_proc_io_fsm_t {
 
 static sample_ret_t proc_sample_io(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_io_t **store)
 {
-	int			i, len, total = 0;
+	int			i, len;
 	int			changes = 0;
+	char			*buf;
 	vmon_proc_io_fsm_t	state = VMON_PARSER_STATE_PROC_IO_RCHAR_LABEL;
 #define VMON_PREPARE_PARSER
 #include "defs/proc_io.def"
@@ -1111,12 +3500,218 @@ static sample_ret_t proc_sample_io(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_io
 	}
 
 	if (!(*store)) { /* ctor */
-		(*store) = calloc(1, sizeof(vmon_proc_io_t));
-		if (proc->is_thread) {
-			(*store)->io_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/task/%i/io", proc->pid, proc->pid);
-		} else {
-			(*store)->io_fd = openf(vmon, O_RDONLY, vmon->proc_dir, "%i/io", proc->pid);
+		(*store) = slab_alloc(vmon, sizeof(vmon_proc_io_t));
+		(*store)->io_fd = proc_openf(vmon, proc, 0, "io");
+
+		/* initially everything is considered changed */
+		memset((*store)->changed, 0xff, sizeof((*store)->changed));
+	} else {
+		/* clear the entire changed bitmap */
+		memset((*store)->changed, 0, sizeof((*store)->changed));
+	}
+
+	/* read in io and parse it assigning the io members accordingly */
+	if ((len = read_contents(vmon, (*store)->io_fd, &(*store)->io_size, &buf)) > 0) {
+		for (i = 0; i < len; i++) {
+			/* parse the fields from the file, stepping through... */
+			_p.input = buf[i];
+			switch (state) {
+#define VMON_IMPLEMENT_PARSER
+#include "defs/proc_io.def"
+				default:
+					/* we're finished parsing once we've fallen off the end of the symbols */
+					goto _out;
+			}
+		}
+	}
+
+_out:
+	return changes ? SAMPLE_CHANGED : SAMPLE_UNCHANGED;
+}
+
+
+/* implements the scheduler statistics sampling */
+typedef enum _vmon_proc_schedstat_fsm_t {
+#define VMON_ENUM_PARSER_STATES
+#include "defs/proc_schedstat.def"
+} vmon_proc_schedstat_fsm_t;
+
+static sample_ret_t proc_sample_schedstat(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_schedstat_t **store)
+{
+	int				i, len;
+	int				changes = 0;
+	char				*buf;
+	fields_t			_f;
+	vmon_proc_schedstat_fsm_t	state = VMON_PARSER_STATE_PROC_SCHEDSTAT_CPU_TIME;
+#define VMON_PREPARE_PARSER
+#include "defs/proc_schedstat.def"
+
+	assert(vmon);
+	assert(store);
+
+	if (!proc) { /* dtor */
+		try_close(&(*store)->schedstat_fd);
+
+		return DTOR_FREE;
+	}
+
+	if (!(*store)) { /* ctor */
+		(*store) = slab_alloc(vmon, sizeof(vmon_proc_schedstat_t));
+		(*store)->schedstat_fd = proc_openf(vmon, proc, 0, "schedstat");
+
+		/* initially everything is considered changed */
+		memset((*store)->changed, 0xff, sizeof((*store)->changed));
+	} else {
+		/* clear the entire changed bitmap */
+		memset((*store)->changed, 0, sizeof((*store)->changed));
+	}
+
+	/* read in schedstat and parse it assigning the schedstat members accordingly */
+	if ((len = read_contents(vmon, (*store)->schedstat_fd, &(*store)->schedstat_size, &buf)) > 0) {
+		if (fields_init(&_f, buf, len)) {
+			switch (state) {
+#define VMON_IMPLEMENT_FIELDS_PARSER
+#include "defs/proc_schedstat.def"
+			}
+
+			goto _out;
+		}
+
+		for (i = 0; i < len; i++) {
+			/* parse the fields from the file, stepping through... */
+			_p.input = buf[i];
+			switch (state) {
+#define VMON_IMPLEMENT_PARSER
+#include "defs/proc_schedstat.def"
+				default:
+					/* we're finished parsing once we've fallen off the end of the symbols */
+					goto _out;
+			}
+		}
+	}
+
+_out:
+	return changes ? SAMPLE_CHANGED : SAMPLE_UNCHANGED;
+}
+
+
+/* taskstats_drain() has already summed any exits into the store, all that's left is presenting them as this sample's changes */
+static sample_ret_t proc_sample_exit(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_exit_t **store)
+{
+	assert(vmon);
+	assert(store);
+
+	if (!proc) /* dtor */
+		return DTOR_FREE;
+
+	if (!(*store)) /* implicit ctor on first sample */
+		(*store) = slab_alloc(vmon, sizeof(vmon_proc_exit_t));
+
+	if ((*store)->reported) {
+		(*store)->reported = 0;
+
+		return SAMPLE_CHANGED;
+	}
+
+	memset((*store)->changed, 0, sizeof((*store)->changed));
+
+	return SAMPLE_UNCHANGED;
+}
+
+
+/* implements the perf_event counters sampling, the counters are indexed by their datum's symbol */
+static const struct {
+	unsigned	group;	/* 0 for software counters, 1 for hardware */
+	__u32		type;
+	__u64		config;
+} proc_perf_counters[VMON_PROC_PERF_NR] = {
+	[VMON_PROC_PERF_TASK_CLOCK] =		{ 0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	[VMON_PROC_PERF_CONTEXT_SWITCHES] =	{ 0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[VMON_PROC_PERF_CPU_MIGRATIONS] =	{ 0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	[VMON_PROC_PERF_PAGE_FAULTS] =		{ 0, PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	[VMON_PROC_PERF_CYCLES] =		{ 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[VMON_PROC_PERF_INSTRUCTIONS] =		{ 1, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+};
+
+#define PROC_PERF_GROUPS	2
+
+/* open the counters of proc's task, the first of each group to open leads it, a group whose leader can't be opened is absent */
+static void proc_perf_open(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_perf_t *store)
+{
+	int	leaders[PROC_PERF_GROUPS] = { -1, -1 };
+	int	failed[PROC_PERF_GROUPS] = {};
+	int	n = 0;
+
+	/* the counters are pinned, they're limited to half the budget so they can't crowd out the /proc handles and leave them thrashing */
+	if (vmon->fd_budget && __atomic_load_n(&vmon->pinned_fds_nr, __ATOMIC_RELAXED) + VMON_PROC_PERF_NR > vmon->fd_budget / 2)
+		failed[0] = failed[1] = 1;
+
+	for (int i = 0; i < VMON_PROC_PERF_NR; i++) {
+		unsigned		group = proc_perf_counters[i].group;
+		struct perf_event_attr	attr = {
+						.size = sizeof(attr),
+						.type = proc_perf_counters[i].type,
+						.config = proc_perf_counters[i].config,
+						.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING,
+						.exclude_hv = 1,
+					};
+
+		store->fds[i] = -1;
+		if (failed[group])
+			continue;
+
+		while ((store->fds[i] = syscall(SYS_perf_event_open, &attr, proc->pid, -1, leaders[group], PERF_FLAG_FD_CLOEXEC)) == -1 &&
+		       errno == EMFILE && fd_cache_shed(vmon));
+
+		if (store->fds[i] == -1) {
+			if (leaders[group] == -1)
+				failed[group] = 1;
+
+			continue;
+		}
+
+		if (leaders[group] == -1)
+			leaders[group] = store->fds[i];
+	}
+
+	/* a reaped process's pid may already be someone else's, don't count them as proc */
+	if (pidfd_reaped(proc)) {
+		for (int i = 0; i < VMON_PROC_PERF_NR; i++)
+			try_close(&store->fds[i]);
+	}
+
+	for (int i = 0; i < VMON_PROC_PERF_NR; i++)
+		n += store->fds[i] >= 0;
+
+	fd_cache_pin(vmon, n);
+}
+
+
+static sample_ret_t proc_sample_perf(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_perf_t **store)
+{
+	int	changes = 0;
+
+	assert(vmon);
+	assert(store);
+
+	if (proc && proc->is_thread && proc->parent && proc->pid == proc->parent->pid) /* the main thread is counted by its process's counters */
+		return SAMPLE_UNCHANGED;
+
+	if (!proc) { /* dtor */
+		int	n = 0;
+
+		for (int i = 0; i < VMON_PROC_PERF_NR; i++) {
+			n += (*store)->fds[i] >= 0;
+			try_close(&(*store)->fds[i]);
 		}
+		fd_cache_pin(vmon, -n);
+
+		return DTOR_FREE;
+	}
+
+	if (!(*store)) { /* ctor */
+		(*store) = slab_alloc(vmon, sizeof(vmon_proc_perf_t));
+		proc_perf_open(vmon, proc, *store);
 
 		/* initially everything is considered changed */
 		memset((*store)->changed, 0xff, sizeof((*store)->changed));
@@ -1125,24 +3720,53 @@ static sample_ret_t proc_sample_io(vmon_t *vmon, vmon_proc_t *proc, vmon_proc_io
 		memset((*store)->changed, 0, sizeof((*store)->changed));
 	}
 
-	/* read in io and parse it assigning the io members accordingly */
-	while ((len = try_pread((*store)->io_fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		total += len;
+	for (unsigned group = 0; group < PROC_PERF_GROUPS; group++) {
+		__u64	buf[3 + VMON_PROC_PERF_NR];	/* { nr, time_enabled, time_running, values[nr] } */
+		int	leader = -1, n = 0;
+		ssize_t	len;
 
-		for (i = 0; i < len; i++) {
-			/* parse the fields from the file, stepping through... */
-			_p.input = vmon->buf[i];
-			switch (state) {
-#define VMON_IMPLEMENT_PARSER
-#include "defs/proc_io.def"
-				default:
-					/* we're finished parsing once we've fallen off the end of the symbols */
-					goto _out; /* this saves us the EOF read syscall */
+		for (int i = 0; i < VMON_PROC_PERF_NR && leader == -1; i++) {
+			if (proc_perf_counters[i].group == group)
+				leader = (*store)->fds[i];
+		}
+
+		if (leader == -1)
+			continue;
+
+		len = read(leader, buf, sizeof(buf));
+		if (len < (ssize_t)(3 * sizeof(__u64)) || len < (ssize_t)((3 + buf[0]) * sizeof(__u64)))
+			continue;
+
+		/* the values follow in the order the counters joined the group, scale any which were multiplexed */
+		for (int i = 0; i < VMON_PROC_PERF_NR && n < buf[0]; i++) {
+			unsigned long long	*datum, value = buf[3 + n];
+
+			if (proc_perf_counters[i].group != group || (*store)->fds[i] == -1)
+				continue;
+
+			n++;
+			if (buf[2] && buf[2] < buf[1])
+				value = (double)value * buf[1] / buf[2];
+
+			switch (i) {
+			case VMON_PROC_PERF_TASK_CLOCK:		datum = &(*store)->task_clock_ns; break;
+			case VMON_PROC_PERF_CONTEXT_SWITCHES:	datum = &(*store)->context_switches; break;
+			case VMON_PROC_PERF_CPU_MIGRATIONS:	datum = &(*store)->cpu_migrations; break;
+			case VMON_PROC_PERF_PAGE_FAULTS:	datum = &(*store)->page_faults; break;
+			case VMON_PROC_PERF_CYCLES:		datum = &(*store)->cycles; break;
+			case VMON_PROC_PERF_INSTRUCTIONS:	datum = &(*store)->instructions; break;
+			default:
+				assert(0);
+			}
+
+			if (*datum != value) {
+				*datum = value;
+				BITSET((*store)->changed, i);
+				changes++;
 			}
 		}
 	}
 
-_out:
 	return changes ? SAMPLE_CHANGED : SAMPLE_UNCHANGED;
 }
 
@@ -1157,8 +3781,9 @@ typedef enum _vmon_sys_stat_fsm_t {
 /* system-wide stat sampling, things like CPU usages, stuff in /proc/stat */
 static sample_ret_t sys_sample_stat(vmon_t *vmon, vmon_sys_stat_t **store)
 {
-	int				i, len, total = 0;
+	int				i, len;
 	int				changes = 0;
+	char				*buf;
 	vmon_sys_stat_fsm_t		state = VMON_PARSER_STATE_SYS_STAT_CPU_PREFIX;	/* this could be defined as the "VMON_PARSER_INITIAL_STATE" */
 	struct timespec			ts;
 	typeof((*store)->boottime)	boottime;
@@ -1191,18 +3816,16 @@ static sample_ret_t sys_sample_stat(vmon_t *vmon, vmon_sys_stat_t **store)
 		changes++;
 	}
 
-	while ((len = try_pread((*store)->stat_fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		total += len;
-
+	if ((len = read_contents(vmon, (*store)->stat_fd, &(*store)->stat_size, &buf)) > 0) {
 		for (i = 0; i < len; i++) {
-			_p.input = vmon->buf[i];
+			_p.input = buf[i];
 			switch (state) {
 #define VMON_PARSER_DELIM ' ' /* TODO XXX eliminate the need for this, I want the .def's to include all the data format knowledge */
 #define VMON_IMPLEMENT_PARSER
 #include "defs/sys_stat.def"
 				default:
 					/* we're finished parsing once we've fallen off the end of the symbols */
-					goto _out; /* this saves us the EOF read syscall */
+					goto _out;
 			}
 		}
 	}
@@ -1220,8 +3843,9 @@ typedef enum _vmon_sys_vm_fsm_t {
 
 static sample_ret_t sys_sample_vm(vmon_t *vmon, vmon_sys_vm_t **store)
 {
-	int			i, len, total = 0;
+	int			i, len;
 	int			changes = 0;
+	char			*buf;
 	vmon_sys_vm_fsm_t	state = VMON_PARSER_STATE_SYS_VM_TOTAL_KB_LABEL; /* this could be defined as the "VMON_PARSER_INITIAL_STATE" */
 #define VMON_PREPARE_PARSER
 #include "defs/sys_vm.def"
@@ -1243,18 +3867,16 @@ static sample_ret_t sys_sample_vm(vmon_t *vmon, vmon_sys_vm_t **store)
 		memset((*store)->changed, 0, sizeof((*store)->changed));
 	}
 
-	while ((len = try_pread((*store)->meminfo_fd, vmon->buf, sizeof(vmon->buf), total)) > 0) {
-		total += len;
-
+	if ((len = read_contents(vmon, (*store)->meminfo_fd, &(*store)->meminfo_size, &buf)) > 0) {
 		for (i = 0; i < len; i++) {
-			_p.input = vmon->buf[i];
+			_p.input = buf[i];
 			switch (state) {
 #define VMON_PARSER_DELIM ' ' /* TODO XXX eliminate the need for this, I want the .def's to include all the data format knowledge */
 #define VMON_IMPLEMENT_PARSER
 #include "defs/sys_vm.def"
 				default:
 					/* we're finished parsing once we've fallen off the end of the symbols */
-					goto _out; /* this saves us the EOF read syscall */
+					goto _out;
 			}
 		}
 	}
@@ -1264,12 +3886,304 @@ _out:
 }
 
 
+/* invoke the samplers in wants for proc, accumulating their activity */
+static void sample_wants(vmon_t *vmon, vmon_proc_t *proc, int wants)
+{
+	int	i, cur;
+
+	for (i = 0, cur = 1; wants; cur <<= 1, i++) {
+		if (wants & cur) {
+			if (vmon->proc_funcs[i](vmon, proc, &proc->stores[i]) == SAMPLE_CHANGED)
+				proc->activity |= cur;
+
+			wants &= ~cur;
+		}
+	}
+}
+
+/* decide if proc's idle wants are skipped this sample, any hierarchy or exec activity returns it to full rate */
+static void idle_skip(vmon_t *vmon, vmon_proc_t *proc)
+{
+	proc->idle_skip = 0;
+
+	if (proc->children_changed || proc->threads_changed || proc->reload) {
+		proc->idle_interval = proc->idle_countdown = 0;
+		return;
+	}
+
+	if (!proc->idle_countdown)
+		return;
+
+	proc->idle_countdown--;
+	proc->idle_skip = 1;
+
+	/* the skipped stores retain their contents, but nothing in them changed this sample */
+	if (proc->stores[VMON_STORE_PROC_STAT])
+		memset(((vmon_proc_stat_t *)proc->stores[VMON_STORE_PROC_STAT])->changed, 0, sizeof(((vmon_proc_stat_t *)0)->changed));
+
+	if (proc->stores[VMON_STORE_PROC_VM])
+		memset(((vmon_proc_vm_t *)proc->stores[VMON_STORE_PROC_VM])->changed, 0, sizeof(((vmon_proc_vm_t *)0)->changed));
+
+	if (proc->stores[VMON_STORE_PROC_IO])
+		memset(((vmon_proc_io_t *)proc->stores[VMON_STORE_PROC_IO])->changed, 0, sizeof(((vmon_proc_io_t *)0)->changed));
+
+	if (proc->stores[VMON_STORE_PROC_PERF])
+		memset(((vmon_proc_perf_t *)proc->stores[VMON_STORE_PROC_PERF])->changed, 0, sizeof(((vmon_proc_perf_t *)0)->changed));
+
+	if (proc->stores[VMON_STORE_PROC_SCHEDSTAT])
+		memset(((vmon_proc_schedstat_t *)proc->stores[VMON_STORE_PROC_SCHEDSTAT])->changed, 0, sizeof(((vmon_proc_schedstat_t *)0)->changed));
+}
+
+
+/* having sampled proc's idle wants, double the interval to the next sampling if nothing moved, or return to full rate */
+static void idle_update(vmon_t *vmon, vmon_proc_t *proc)
+{
+	vmon_proc_stat_t	*proc_stat = proc->stores[VMON_STORE_PROC_STAT];
+
+	proc->sampled_generation = vmon->generation;
+
+	if (!(vmon->flags & VMON_FLAG_ADAPTIVE))
+		return;
+
+	/* wchan isn't (yet) counted in the stat sampler's changes, see the XXX in proc_sample_stat() */
+	if ((proc->activity & IDLE_WANTS) || (proc_stat && BITTEST(proc_stat->changed, VMON_PROC_STAT_WCHAN))) {
+		proc->idle_interval = proc->idle_countdown = 0;
+		return;
+	}
+
+	proc->idle_interval = proc->idle_interval ? proc->idle_interval << 1 : 1;
+	if (proc->idle_interval > VMON_IDLE_INTERVAL_MAX)
+		proc->idle_interval = VMON_IDLE_INTERVAL_MAX;
+
+	proc->idle_countdown = proc->idle_interval;
+}
+
+
+/* the wants of proc which sample() leaves until after the hierarchy has been maintained, less any skipped as idle */
+static int deferred_wants(vmon_t *vmon, vmon_proc_t *proc)
+{
+	int	wants = (proc->wants ? proc->wants : vmon->proc_wants) & ~POOL_SERIAL_WANTS;
+
+	if (proc->idle_skip)
+		wants &= ~IDLE_WANTS;
+
+	return wants;
+}
+
+
+static void sample_deferred(vmon_t *vmon, vmon_proc_t *proc)
+{
+	int	wants = deferred_wants(vmon, proc);
+
+	sample_wants(vmon, proc, wants);
+
+	if ((wants & IDLE_WANTS))
+		idle_update(vmon, proc);
+}
+
+
+static void pool_queue(vmon_t *vmon, vmon_proc_t *proc)
+{
+	struct _vmon_pool_t	*pool = vmon->pool;
+
+	if (pool->nodes_nr >= pool->nodes_alloc_nr) {
+		int		nr = pool->nodes_alloc_nr ? pool->nodes_alloc_nr * 2 : 256;
+		vmon_proc_t	**nodes;
+
+		nodes = realloc(pool->nodes, nr * sizeof(vmon_proc_t *));
+		if (!nodes) {
+			/* just do it here */
+			sample_deferred(vmon, proc);
+			fd_cache_update(vmon, proc);
+			return;
+		}
+
+		pool->nodes = nodes;
+		pool->nodes_alloc_nr = nr;
+	}
+
+	pool->nodes[pool->nodes_nr++] = proc;
+}
+
+
+/* claim and sample queued nodes until there are none left */
+static void pool_work(struct _vmon_pool_t *pool)
+{
+	vmon_t	*vmon = pool->vmon;
+	int	i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->nodes_nr)
+		sample_deferred(vmon, pool->nodes[i]);
+}
+
+
+static void * pool_thread(void *arg)
+{
+	struct _vmon_pool_t	*pool = arg;
+	unsigned		round = 0;
+
+	is_worker = 1;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->round == round)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+
+		if (pool->quit)
+			break;
+
+		round = pool->round;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->busy)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	free(worker_buf);
+
+	return NULL;
+}
+
+
+static void pool_destroy(struct _vmon_pool_t *pool)
+{
+	int	i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads_nr; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->strs_lock);
+	pthread_mutex_destroy(&pool->slab_lock);
+	pthread_mutex_destroy(&pool->lock);
+	try_free((void **)&pool->threads);
+	try_free((void **)&pool->nodes);
+	free(pool);
+}
+
+
+/* create a pool of workers, the calling thread participates in the sampling too so there's one less than the number of cpus */
+static struct _vmon_pool_t * pool_create(vmon_t *vmon)
+{
+	struct _vmon_pool_t	*pool;
+
+	pool = calloc(1, sizeof(struct _vmon_pool_t));
+	if (!pool)
+		return NULL;
+
+	pool->vmon = vmon;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_mutex_init(&pool->slab_lock, NULL);
+	pthread_mutex_init(&pool->strs_lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	if (vmon->num_cpus > 1) {
+		pool->threads = calloc(vmon->num_cpus - 1, sizeof(pthread_t));
+		if (!pool->threads)
+			goto _err;
+
+		for (; pool->threads_nr < vmon->num_cpus - 1; pool->threads_nr++) {
+			if (pthread_create(&pool->threads[pool->threads_nr], NULL, pool_thread, pool))
+				break; /* make do with what we got */
+		}
+	}
+
+	return pool;
+
+_err:
+	pool_destroy(pool);
+
+	return NULL;
+}
+
+
+/* run the deferred samplers over the nodes queued by pass 1 */
+static void pool_sample(vmon_t *vmon)
+{
+	struct _vmon_pool_t	*pool = vmon->pool;
+	int			i;
+
+	pool->next = 0;
+
+	if (pool->threads_nr && pool->nodes_nr >= POOL_MIN_NODES) {
+		pthread_mutex_lock(&pool->lock);
+		pool->busy = pool->threads_nr;
+		pool->round++;
+		pthread_cond_broadcast(&pool->start_cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_work(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		while (pool->busy)
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		pthread_mutex_unlock(&pool->lock);
+	} else {
+		pool_work(pool);
+	}
+
+	for (i = 0; i < pool->nodes_nr; i++)
+		fd_cache_update(vmon, pool->nodes[i]);
+
+	pool->nodes_nr = 0;
+}
+
+
 /* here begins the public interface */
 
+/* have the next sample re-read the process' exec-sensitive details (cmdline, exe) which are otherwise only reloaded when an exec is detected.
+ * Without VMON_FLAG_PROC_EVENTS, execs of processes the caller can't ptrace are only detected when they change comm, since the kernel masks
+ * the address space layout in their stat, callers needing cmdline/exe current for such processes have to request reloads themselves.
+ */
+void vmon_proc_reload(vmon_t *vmon, vmon_proc_t *proc)
+{
+	assert(vmon);
+	assert(proc);
+
+	proc->reload = 1;
+}
+
+
+/* find an already monitored process (or thread when is_thread is set) by pid, returns NULL if not monitored */
+vmon_proc_t * vmon_proc_lookup(vmon_t *vmon, int pid, int is_thread)
+{
+	unsigned	mask, i;
+	uint32_t	key;
+
+	assert(vmon);
+
+	if (pid < 0)
+		return NULL;
+
+	key = htab_key(pid, is_thread ? 1 : 0);
+	mask = (1 << vmon->htab_bits) - 1;
+	for (i = htab_slot(vmon, key); vmon->htab[i].proc; i = (i + 1) & mask) {
+		if (vmon->htab[i].key == key)
+			return vmon->htab[i].proc;
+	}
+
+	return NULL;
+}
+
+
 /* initialize a vmon instance, proc_wants is a default wants mask, optionally inherited vmon_proc_monitor() calls */
 int vmon_init(vmon_t *vmon, vmon_flags_t flags, vmon_sys_wants_t sys_wants, vmon_proc_wants_t proc_wants)
 {
-	int	i;
+	struct rlimit	rlim;
 
 	assert(vmon);
 
@@ -1282,18 +4196,36 @@ int vmon_init(vmon_t *vmon, vmon_flags_t flags, vmon_sys_wants_t sys_wants, vmon
 	INIT_LIST_HEAD(&vmon->processes);
 	INIT_LIST_HEAD(&vmon->orphans);
 
-	for (i = 0; i < VMON_HTAB_SIZE; i++)
-		INIT_LIST_HEAD(&vmon->htab[i]);
+	vmon->htab_bits = VMON_HTAB_BITS;
+	vmon->htab_nr = 0;
+	if (!(vmon->htab = calloc(1 << vmon->htab_bits, sizeof(vmon_htab_slot_t))))
+		return 0;
 
 	memset(vmon->stores, 0, sizeof(vmon->stores));
+	memset(vmon->slabs, 0, sizeof(vmon->slabs));
+	vmon->slab_heap_nr = 0;
+
+	vmon->buf = NULL;
+	vmon->buf_size = 0;
+	vmon->scan_pids = NULL;
+	vmon->scan_pids_size = 0;
+	vmon->scan_procs = NULL;
+	vmon->scan_procs_size = 0;
 
 	/* TODO XXX: rename to something processes-specific! see vmon.h */
 	vmon->array = NULL;
-	vmon->array_allocated_nr = vmon->array_active_nr = vmon->array_hint_free = 0;
+	vmon->array_free = NULL;
+	vmon->array_allocated_nr = vmon->array_active_nr = vmon->array_free_nr = 0;
 
-	/* TODO XXX: this is temporary, see vmon.h */
-	INIT_LIST_HEAD(&vmon->fobjects);
+	memset(vmon->fobjects, 0, sizeof(vmon->fobjects));
 	vmon->fobjects_nr = 0;
+	memset(&vmon->strs, 0, sizeof(vmon->strs));
+
+	/* leave half the fds for the caller and the handles outside the cache */
+	INIT_LIST_HEAD(&vmon->fd_lru);
+	vmon->fd_budget = (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur != RLIM_INFINITY) ? rlim.rlim_cur / 2 : 0;
+	vmon->fds_nr = vmon->pinned_fds_nr = 0;
+	vmon->fd_cache_hits = vmon->fd_cache_misses = 0;
 
 	vmon->flags = flags;
 	vmon->sys_wants = sys_wants;
@@ -1312,6 +4244,36 @@ int vmon_init(vmon_t *vmon, vmon_flags_t flags, vmon_sys_wants_t sys_wants, vmon
 	vmon->proc_funcs[VMON_STORE_ ## _sym] = (int(*)(vmon_t *, vmon_proc_t *, void **))_func;
 #include "defs/proc_wants.def"
 
+	vmon->pool = NULL;
+	if ((flags & VMON_FLAG_PARALLEL) && (flags & VMON_FLAG_2PASS))
+		vmon->pool = pool_create(vmon); /* on failure we silently sample serially */
+
+	vmon->uring = NULL;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (flags & VMON_FLAG_IO_URING)
+		vmon->uring = uring_open(); /* on failure we silently fall back to pread() */
+#endif
+
+	vmon->proc_events_fd = -1;
+	if (flags & VMON_FLAG_PROC_EVENTS)
+		vmon->proc_events_fd = proc_events_open(); /* on failure we silently fall back to reading the children files */
+
+	vmon->taskstats_fd = -1;
+	if (proc_wants & VMON_WANT_PROC_EXIT)
+		vmon->taskstats_fd = taskstats_open(&vmon->taskstats_family); /* on failure the exit stores silently stay empty */
+
+	vmon->pidfds_fd = -1;
+	if (flags & VMON_FLAG_PIDFD)
+		vmon->pidfds_fd = epoll_create1(EPOLL_CLOEXEC); /* on failure we silently track processes by pid alone */
+
+	vmon->ppids = NULL;
+	if (flags & VMON_FLAG_PPID_HIERARCHY)
+		vmon->ppids = calloc(1, sizeof(struct _vmon_ppids_t)); /* on failure we silently fall back to reading the children files */
+
+	vmon->order = NULL;
+	if (flags & VMON_FLAG_2PASS)
+		vmon->order = calloc(1, sizeof(struct _vmon_order_t)); /* on failure we silently keep recursing */
+
 	vmon->sample_cb = NULL;
 	vmon->proc_ctor_cb = NULL;
 	vmon->proc_dtor_cb = NULL;
@@ -1325,8 +4287,37 @@ int vmon_init(vmon_t *vmon, vmon_flags_t flags, vmon_sys_wants_t sys_wants, vmon
 /* destroy vmon instance */
 void vmon_destroy(vmon_t *vmon)
 {
+	int	i;
+
 	/* TODO: do we want to forcibly unmonitor everything being monitored still, or require the caller to have done that beforehand? */
 	/* TODO: cleanup other shit, like closedir(vmon->proc_dir), etc */
+	try_close(&vmon->proc_events_fd);
+	try_close(&vmon->pidfds_fd);
+	try_close(&vmon->taskstats_fd);
+	ppids_destroy(vmon->ppids);
+	vmon->ppids = NULL;
+	order_destroy(vmon->order);
+	vmon->order = NULL;
+	pool_destroy(vmon->pool);
+	vmon->pool = NULL;
+#ifdef HAVE_LINUX_IO_URING_H
+	uring_close(vmon->uring);
+	vmon->uring = NULL;
+#endif
+	slab_destroy(vmon);
+	try_free((void **)&vmon->htab);
+	for (i = 0; i < VMON_FOBJECT_TYPE_NR; i++)
+		try_free((void **)&vmon->fobjects[i].buckets);
+	try_free((void **)&vmon->strs.buckets);
+	try_free((void **)&vmon->buf);
+	vmon->buf_size = 0;
+	try_free((void **)&vmon->scan_pids);
+	vmon->scan_pids_size = 0;
+	try_free((void **)&vmon->scan_procs);
+	vmon->scan_procs_size = 0;
+	try_free((void **)&vmon->array);
+	try_free((void **)&vmon->array_free);
+	vmon->array_allocated_nr = vmon->array_active_nr = vmon->array_free_nr = 0;
 }
 
 
@@ -1380,17 +4371,14 @@ void vmon_proc_unmonitor(vmon_t *vmon, vmon_proc_t *proc, void (*sample_cb)(vmon
 	}
 
 	/* if maintaining a process array NULL out the entry */
-	if ((vmon->flags & VMON_FLAG_PROC_ARRAY) && (i = find_proc_in_array(vmon, proc, proc->array_hint_pos)) != -1) {
-		vmon->array[i] = NULL;
-		/* store its index if the current free hint isn't free, or it's lower than the current free hint, making the hint useful */
-		if (vmon->array[vmon->array_hint_free] || i < vmon->array_hint_free)
-			vmon->array_hint_free = i;
-	}
+	if ((vmon->flags & VMON_FLAG_PROC_ARRAY))
+		array_remove(vmon, proc);
 
 	list_del(&proc->siblings);
 	if (proc->is_thread)
 		list_del(&proc->threads);
-	list_del(&proc->bucket);
+	htab_remove(vmon, proc);
+	hierarchy_changed(vmon);
 
 	if (proc->parent) {	/* XXX TODO: verify this works ok for unmonitored orphans */
 		/* set the children changed flag in the parent */
@@ -1404,6 +4392,13 @@ void vmon_proc_unmonitor(vmon_t *vmon, vmon_proc_t *proc, void (*sample_cb)(vmon
 		vmon->processes_changed = 1;
 	}
 
+	/* the stores are going away along with their handles, closing the pidfd also drops it from vmon->pidfds_fd */
+	if (proc->pidfd >= 0)
+		fd_cache_pin(vmon, -1);
+	try_close(&proc->pidfd);
+	list_del_init(&proc->fd_lru);
+	vmon->fds_nr -= proc->fds_nr;
+
 	for (i = 0; i < sizeof(vmon->proc_funcs) / sizeof(vmon->proc_funcs[VMON_STORE_PROC_STAT]); i++) {
 		if (proc->stores[i] != NULL) {	/* any non-NULL stores must have a function installed and must have been sampled, invoke the dtor branch */
 			sample_ret_t	r;
@@ -1411,7 +4406,7 @@ void vmon_proc_unmonitor(vmon_t *vmon, vmon_proc_t *proc, void (*sample_cb)(vmon
 			r = vmon->proc_funcs[i](vmon, NULL, &proc->stores[i]);
 			switch (r) {
 			case DTOR_FREE:
-				try_free((void **)&proc->stores[i]);
+				try_slab_free(vmon, (void **)&proc->stores[i]);
 				break;
 			case DTOR_NOFREE:
 				break;
@@ -1425,14 +4420,14 @@ void vmon_proc_unmonitor(vmon_t *vmon, vmon_proc_t *proc, void (*sample_cb)(vmon
 	if (vmon->proc_dtor_cb)
 		vmon->proc_dtor_cb(vmon, proc);
 
-	free(proc);
+	slab_free(vmon, proc);
 }
 
 
 /* internal sampling helper, perform sampling for a given process */
 static void sample(vmon_t *vmon, vmon_proc_t *proc)
 {
-	int	i, wants, cur;
+	int	wants;
 
 	assert(vmon);
 	assert(proc);
@@ -1443,13 +4438,31 @@ static void sample(vmon_t *vmon, vmon_proc_t *proc)
 	wants = proc->wants ? proc->wants : vmon->proc_wants;
 
 	proc->activity = 0;
-	for (i = 0, cur = 1; wants; cur <<= 1, i++) {
-		if (wants & cur) {
-			if (vmon->proc_funcs[i](vmon, proc, &proc->stores[i]) == SAMPLE_CHANGED)
-				proc->activity |= cur;
 
-			wants &= ~cur;
+	/* the hierarchy is maintained first, serially as usual */
+	fd_cache_restore(vmon, proc, wants & POOL_SERIAL_WANTS);
+	sample_wants(vmon, proc, wants & POOL_SERIAL_WANTS);
+
+	if ((vmon->flags & VMON_FLAG_ADAPTIVE))
+		idle_skip(vmon, proc);
+
+	/* reopening must happen here rather than in the pool, the cache isn't thread-safe */
+	fd_cache_restore(vmon, proc, deferred_wants(vmon, proc));
+
+	if (vmon->pool) {
+		/* the rest gets deferred to pool_sample() */
+		if (deferred_wants(vmon, proc)) {
+			/* the queued processes hold their handles open until the pool runs, run it early rather than exceed the fd budget */
+			if (vmon->fd_budget && vmon->pool->nodes_nr * PROC_HANDLES_MAX >= vmon->fd_budget)
+				pool_sample(vmon);
+
+			pool_queue(vmon, proc);
+		} else {
+			fd_cache_update(vmon, proc);
 		}
+	} else {
+		sample_deferred(vmon, proc);
+		fd_cache_update(vmon, proc);
 	}
 }
 
@@ -1500,7 +4513,10 @@ static int sample_threads_pass2(vmon_t *vmon, list_head_t *threads)
 	assert(threads);
 
 	list_for_each_entry(proc, threads, threads) {
+		int	pre = order_enter(vmon, proc, 0);
+
 		sample_siblings_pass2(vmon, &proc->children); /* invoke samplers for this thread's children (which strangely is a thing) */
+		order_leave(vmon, pre, NULL);
 	}
 
 	return 1;
@@ -1532,6 +4548,7 @@ static int sample_siblings_unipass(vmon_t *vmon, list_head_t *siblings)
 		if (siblings == &vmon->processes && proc->parent) {
 			list_del(&proc->siblings);
 			list_add_tail(&proc->siblings, &proc->parent->children);
+			hierarchy_changed(vmon);
 			continue;
 		}
 
@@ -1548,10 +4565,12 @@ static int sample_siblings_unipass(vmon_t *vmon, list_head_t *siblings)
 	}
 
 	/* if we've just finished the top-level processes, and we have some orphans, we want to make the orphans top-level processes and sample them as such */
-	if (siblings == &vmon->processes && !list_empty(&vmon->orphans))
+	if (siblings == &vmon->processes && !list_empty(&vmon->orphans)) {
 		/* XXX TODO: do I need to get these orphans sampled immediately for this sample?  Are they getting skipped this sample?
 		 * TODO: instrument the samplers to see if generation is > 1 behind to detect drops... */
 		list_splice_init(&vmon->orphans, vmon->processes.prev);
+		hierarchy_changed(vmon);
+	}
 
 	return 1;
 }
@@ -1583,14 +4602,17 @@ static int sample_siblings_pass1(vmon_t *vmon, list_head_t *siblings)
 			if (proc->parent) {
 				list_del(&proc->siblings);
 				list_add_tail(&proc->siblings, &proc->parent->children);
+				hierarchy_changed(vmon);
 			}
 		}
 	}
 
-	if (siblings == &vmon->processes && !list_empty(&vmon->orphans))
+	if (siblings == &vmon->processes && !list_empty(&vmon->orphans)) {
 		/* XXX TODO: do I need to get these orphans sampled immediately for this sample?  Are they getting skipped this sample?
 		 * TODO: instrument the samplers to see if generation is > 1 behind to detect drops and log as bugs... */
 		list_splice_init(&vmon->orphans, vmon->processes.prev);
+		hierarchy_changed(vmon);
+	}
 
 	return 1;
 }
@@ -1603,9 +4625,10 @@ static int sample_siblings_pass2(vmon_t *vmon, list_head_t *siblings)
 	assert(vmon);
 	assert(siblings);
 
-	/* invoke callbacks */
+	/* invoke callbacks, recording the order for the next sample's passes if it's being rebuilt */
 	list_for_each_entry(proc, siblings, siblings) {
 		vmon_proc_callback_t	*cb;
+		int			pre = order_enter(vmon, proc, siblings == &vmon->processes);
 
 		sample_threads_pass2(vmon, &proc->threads);	/* recurse into any children of the threads, invoking callbacks as encountered from the leaves up */
 		sample_siblings_pass2(vmon, &proc->children);	/* recurse into children, we invoke callbacks as encountered on nodes from the leaves up */
@@ -1619,6 +4642,84 @@ static int sample_siblings_pass2(vmon_t *vmon, list_head_t *siblings)
 								 * May be able to leverage the generation number and turn the top-level sampler into more of a follower analog???
 								 */
 			proc->is_new = 0;
+
+		order_leave(vmon, pre, proc);
+	}
+
+	return 1;
+}
+
+
+/* 2pass version of the internal sampling helper sweeping the order built by sample_siblings_pass2(), only usable while order_current() */
+static int sample_order_pass1(vmon_t *vmon)
+{
+	struct _vmon_order_t	*order = vmon->order;
+	int			i;
+
+	assert(vmon);
+	assert(order);
+
+	/* invoke samplers */
+	for (i = 0; i < order->pre_nr;) {
+		order_node_t	*node = &order->pre[i];
+		vmon_proc_t	*proc = node->proc;
+		unsigned	changes = order->changes;
+
+		sample(vmon, proc);
+
+		if (order->changes == changes) {
+			i++;
+		} else {
+			/* sampling proc changed the hierarchy beneath it, possibly freeing processes in the rest of its subtree's order,
+			 * so just that subtree is walked from the lists, the rest of the order is unaffected */
+			if (!proc->is_thread)
+				sample_threads_pass1(vmon, &proc->threads);
+			sample_siblings_pass1(vmon, &proc->children);
+			i = node->end;
+		}
+
+		/* see sample_siblings_pass1() */
+		if (node->toplevel) {
+			proc->generation = vmon->generation;
+
+			if (proc->parent) {
+				list_del(&proc->siblings);
+				list_add_tail(&proc->siblings, &proc->parent->children);
+				hierarchy_changed(vmon);
+			}
+		}
+	}
+
+	if (!list_empty(&vmon->orphans)) {
+		list_splice_init(&vmon->orphans, vmon->processes.prev);
+		hierarchy_changed(vmon);
+	}
+
+	return 1;
+}
+
+
+/* 2pass version of the internal callbacks helper sweeping the order built by sample_siblings_pass2(), only usable while order_current().
+ * Like the lists, the order can't withstand callbacks unmonitoring processes other than their own.
+ */
+static int sample_order_pass2(vmon_t *vmon)
+{
+	struct _vmon_order_t	*order = vmon->order;
+	int			i;
+
+	assert(vmon);
+	assert(order);
+
+	/* invoke callbacks */
+	for (i = 0; i < order->post_nr; i++) {
+		vmon_proc_t		*proc = order->post[i];
+		vmon_proc_callback_t	*cb;
+
+		list_for_each_entry(cb, &proc->sample_callbacks, callbacks)
+			cb->func(vmon, vmon->sample_cb_arg, proc, cb->arg);
+
+		if (!proc->parent && proc->is_new) /* see sample_siblings_pass2() */
+			proc->is_new = 0;
 	}
 
 	return 1;
@@ -1634,64 +4735,67 @@ int vmon_sample(vmon_t *vmon)
 
 	vmon->generation++;
 
-	/* first manage the "all processes monitored" use case, this doesn't do any sampling, it just maintains the top-level list of processes being monitored */
-	/* note this doesn't cover threads, as linux doesn't expose threads in the readdir of /proc, even though you can directly look them up at /proc/$tid */
-	if ((vmon->flags & VMON_FLAG_PROC_ALL)) {
-		struct dirent	*dentry;
-		list_head_t	*tmp, *_tmp = &vmon->processes;
+	/* bring the hierarchy up to date with any proc connector events or a ppid scan before walking it */
+	if (vmon->proc_events_fd != -1)
+		proc_events_drain(vmon);
 
-		/* if VMON_FLAG_PROC_ALL flag is set, quite a different code path is used which simply readdir()'s /proc, treating every numeric directory found
-		 * as a process to monitor.  The list of toplevel processes being monitored is kept in sync with these, automatically monitoring
-		 * new processes found, and unmonitoring processes now absent, in a fashion very similar to the proc_sample_files() code. */
-		seekdir(vmon->proc_dir, 0);
-		while ((dentry = readdir(vmon->proc_dir))) {
-			int	pid, found;
+	if (vmon->pidfds_fd != -1)
+		pidfds_drain(vmon);
 
-			if (dentry->d_type != DT_DIR || dentry->d_name[0] < '0' || dentry->d_name[0] > '9')
-				continue; /* skip non-directories and non-numeric directories */
+	if (vmon->taskstats_fd != -1)
+		taskstats_drain(vmon);
 
-			pid = atoi(dentry->d_name);
+	if (vmon->ppids)
+		ppid_scan(vmon);
 
-			found = 0;
-			list_for_each(tmp, _tmp) { /* note how we use _tmp as the head for the processes iteration, resuming from the last process' node */
-				if (tmp == &vmon->processes)
-					continue; /* must take care to skip the processes list_head_t, as it's not a vmon_proc_t */
+	/* first manage the "all processes monitored" use case, this doesn't do any sampling, it just maintains the top-level list of processes being monitored */
+	/* note this doesn't cover threads, as linux doesn't list threads in /proc, even though you can directly look them up at /proc/$tid */
+	if ((vmon->flags & VMON_FLAG_PROC_ALL)) {
+		list_head_t	*cur = vmon->processes.next;
+		vmon_proc_t	*proc;
+		int		n, j;
 
-				if (list_entry(tmp, vmon_proc_t, siblings)->pid == pid) {
-					found = 1;
-					break;
-				}
+		/* if VMON_FLAG_PROC_ALL flag is set, quite a different code path is used which simply scans /proc, treating every numeric directory found
+		 * as a process to monitor.  The list of toplevel processes being monitored is kept in sync with these, automatically monitoring
+		 * new processes found, and unmonitoring processes now absent.  The list is kept in pid order like the scan, so this is a merge
+		 * of the two, processes present in both are left untouched. */
+		n = scan_pids(vmon, vmon->proc_dir);
+		for (j = 0; j < n; j++) {
+			int	pid = vmon->scan_pids[j];
+
+			while (cur != &vmon->processes && (proc = list_entry(cur, vmon_proc_t, siblings))->pid < pid) {
+				cur = cur->next; /* step over it first, unmonitoring removes it from the list */
+				vmon_proc_unmonitor(vmon, proc, NULL, NULL);
 			}
 
-			if (!found) {
-				/* monitor the process */
-				vmon_proc_t	*proc = proc_monitor(vmon, NULL, pid, vmon->proc_wants, NULL, NULL);
-
-				if (!proc)
-					continue; /* TODO error */
-
-				tmp = &proc->siblings;
+			if (cur != &vmon->processes && list_entry(cur, vmon_proc_t, siblings)->pid == pid) {
+				cur = cur->next;
+				continue;
 			}
 
-			list_move_tail(tmp, _tmp); /* place this process next to the current start (XXX there are cases where it's already there) */
-
-			list_entry(tmp, vmon_proc_t, siblings)->generation = vmon->generation; /* for identifying stale nodes */
+			/* monitor the process */
+			proc = proc_monitor(vmon, NULL, pid, vmon->proc_wants, NULL, NULL);
+			if (!proc)
+				continue; /* TODO error */
 
-			_tmp = tmp; /* set this node as the head to start the next search from */
+			list_move_tail(&proc->siblings, cur); /* place it before the next process in pid order */
 		}
 
-		list_for_each_safe(tmp, _tmp, &vmon->processes) { /* XXX safe version needed since vmon_proc_unmonitor() deletes from the processes list */
-			if (list_entry(tmp, vmon_proc_t, siblings)->generation != vmon->generation) {
-				vmon_proc_unmonitor(vmon, list_entry(tmp, vmon_proc_t, siblings), NULL, NULL);
-			} else {
-				/* we can stop looking for stale processes upon finding a non-stale one, since they've been sorted by the above algorithm */
-				break;
-			}
+		/* whatever's past the last pid found has exited, unless the scan failed in which case leave everything be for now */
+		while (n >= 0 && cur != &vmon->processes) {
+			proc = list_entry(cur, vmon_proc_t, siblings);
+			cur = cur->next;
+			vmon_proc_unmonitor(vmon, proc, NULL, NULL);
 		}
 	}
 
 	/* now for actual sampling */
 
+#ifdef HAVE_LINUX_IO_URING_H
+	if (vmon->uring)
+		uring_prefetch(vmon);
+#endif
+
 	/* first the sys-wide samplers */
 	wants = vmon->sys_wants; /* the caller-requested sys-wide wants */
 	vmon->activity = 0;
@@ -1743,9 +4847,24 @@ int vmon_sample(vmon_t *vmon)
 		 * Pass 1. samplers
 		 * Pass 2. callbacks
 		  * XXX this is the path vwm utilizes, everything else is for other uses, like implementing top-like programs.
+		 * While the hierarchy is unchanged since the last sample the passes sweep its flattened order instead of recursing,
+		 * otherwise pass 2 rebuilds the order for the next sample as it goes.
 		 */
-		ret = sample_siblings_pass1(vmon, &vmon->processes);	/* XXX TODO: errors */
-		ret = sample_siblings_pass2(vmon, &vmon->processes);
+		if (order_current(vmon))
+			ret = sample_order_pass1(vmon);
+		else
+			ret = sample_siblings_pass1(vmon, &vmon->processes);	/* XXX TODO: errors */
+
+		if (vmon->pool)
+			pool_sample(vmon);
+
+		if (order_current(vmon)) {
+			ret = sample_order_pass2(vmon);
+		} else {
+			order_begin(vmon);
+			ret = sample_siblings_pass2(vmon, &vmon->processes);
+			order_end(vmon);
+		}
 	} else {
 		/* recursive hierarchical depth-first processes tree sampling, at each node threads come before children, done in a single pass:
 		 * Pass 1. samplers; callbacks (for every node)
@@ -1753,6 +4872,9 @@ int vmon_sample(vmon_t *vmon)
 		ret = sample_siblings_unipass(vmon, &vmon->processes);
 	}
 
+	/* with everything sampled, close the handles of the least recently used processes in excess of the budget */
+	fd_cache_trim(vmon);
+
 	return ret;
 }
 
@@ -1763,12 +4885,18 @@ void vmon_dump_procs(vmon_t *vmon, FILE *out)
 	assert(out);
 
 	fprintf(out, "generation=%i\n", vmon->generation);
-	for (int i = 0; i < VMON_HTAB_SIZE; i++) {
+	fprintf(out, "htab_nr=%i htab_size=%i\n", vmon->htab_nr, 1 << vmon->htab_bits);
+	for (int i = 0; i < VMON_SLAB_CLASSES; i++) {
+		fprintf(out, "slab[%i] size=%i in_use=%u free=%u chunks=%u\n",
+			i, 1 << (SLAB_MIN_SHIFT + i), vmon->slabs[i].in_use_nr, vmon->slabs[i].free_nr, vmon->slabs[i].chunks_nr);
+	}
+	fprintf(out, "slab_heap=%u\n", vmon->slab_heap_nr);
+	for (int i = 0; i < (1 << vmon->htab_bits); i++) {
 		vmon_proc_t	*proc;
 
-		list_for_each_entry(proc, &vmon->htab[i], bucket) {
-			fprintf(out, "[%i] proc=%p parent=%p gen=%i pid=%i rc=%i is_threaded=%i is_thread=%i is_new=%u is_stale=%u\n",
-				i, proc, proc->parent, proc->generation, proc->pid, proc->refcnt, (unsigned)proc->is_threaded, (unsigned)proc->is_thread, (unsigned)proc->is_new, (unsigned)proc->is_stale);
+		if ((proc = vmon->htab[i].proc)) {
+			fprintf(out, "[%i] proc=%p parent=%p gen=%i pid=%i rc=%i is_threaded=%i is_thread=%i is_new=%u is_stale=%u idle_interval=%i\n",
+				i, proc, proc->parent, proc->generation, proc->pid, proc->refcnt, (unsigned)proc->is_threaded, (unsigned)proc->is_thread, (unsigned)proc->is_new, (unsigned)proc->is_stale, proc->idle_interval);
 
 		}
 	}
@@ -10,14 +10,25 @@
 #include "bitmap.h"
 #include "list.h"
 
-#define VMON_HTAB_SIZE		1024				/* number of buckets in the processes hash table */
-#define VMON_ARRAY_GROWBY	5				/* number of elements to grow the processes array */
+#define VMON_HTAB_BITS		10				/* log2 of the initial number of slots in the processes hash table */
+#define VMON_ARRAY_MIN		64				/* initial number of elements in the processes array, it doubles from there */
+#define VMON_SLAB_CLASSES	8				/* number of slab allocator size classes, 32 bytes doubling through 4KiB */
+#define VMON_IDLE_INTERVAL_MAX	8				/* maximum number of samples an idle process may be skipped for under VMON_FLAG_ADAPTIVE */
 
 typedef enum _vmon_flags_t {
 	VMON_FLAG_NONE			= 0,
 	VMON_FLAG_PROC_ARRAY		= 1L,			/* maintain a process array (useful if you need to do things like implement top(1) */
 	VMON_FLAG_PROC_ALL		= 1L << 1,		/* monitor all the processes in the system (XXX this has some follow_children implications...)  */
 	VMON_FLAG_2PASS			= 1L << 2,		/* perform all sampling/wants in a first pass, then invoke all callbacks in second in vmon_sample(), important if your callbacks are layout-sensitive (vwm) */
+	VMON_FLAG_PROC_EVENTS		= 1L << 3,		/* follow children via the netlink proc connector's fork/exit events when permitted, reading the children files only as a fallback */
+	VMON_FLAG_IO_URING		= 1L << 4,		/* batch the per-sample /proc reads through io_uring when available, falling back to pread() */
+	VMON_FLAG_PARALLEL		= 1L << 5,		/* spread the non-hierarchy samplers of VMON_FLAG_2PASS pass 1 across a pool of threads, one per cpu */
+	VMON_FLAG_ADAPTIVE		= 1L << 6,		/* sample the stat/vm/io/perf/schedstat wants of idle processes at exponentially backed off intervals, see vmon_proc_t.sampled_generation */
+	VMON_FLAG_PPID_HIERARCHY	= 1L << 7,		/* follow children by scanning /proc once per sample for processes whose parent is following children, instead of
+								 * reading every children file (no CONFIG_PROC_CHILDREN needed), children of threads are attached to their process,
+								 * the scan walks all of /proc every sample regardless of the monitored subtree sizes, so only use it for hierarchies
+								 * rooted at PID 1 or with VMON_FLAG_PROC_ALL, small subtrees are cheaper to follow via their children files */
+	VMON_FLAG_PIDFD			= 1L << 8,		/* hold a pidfd per monitored process, their exits flag them exited and pid reuse gets caught, see vmon_t.pidfds_fd */
 } vmon_flags_t;
 
 /* store ids, used as indices into the stores array, and shift offsets for the wants mask */
@@ -51,7 +62,7 @@ typedef enum _vmon_proc_wants_t {
 typedef struct _vmon_char_array_t {
 	char	*array;
 	size_t	len;
-	size_t	alloc_len;
+	size_t	alloc_len;	/* 0 when array is the contents of an interned vmon_str_t */
 } vmon_char_array_t;
 
 typedef struct _vmon_str_array_t {
@@ -70,6 +81,7 @@ typedef enum _vmon_sys_stat_sym_t {
 
 typedef struct _vmon_sys_stat_t {
 	int	stat_fd;
+	size_t	stat_size;					/* learned length of /proc/stat, for sizing its reads */
 
 	char	changed[BITNSLOTS(VMON_SYS_STAT_NR)];		/* bitmap for indicating changed fields */
 
@@ -87,6 +99,7 @@ typedef enum _vmon_sys_vm_sym_t {
 
 typedef struct _vmon_sys_vm_t {
 	int	meminfo_fd;
+	size_t	meminfo_size;					/* learned length of /proc/meminfo, for sizing its reads */
 
 	char	changed[BITNSLOTS(VMON_SYS_VM_NR)];		/* bitmap for indicating changed fields */
 
@@ -103,7 +116,8 @@ typedef enum _vmon_proc_stat_sym_t {
 } vmon_proc_stat_sym_t;
 
 typedef struct _vmon_proc_stat_t {
-	int	cmdline_fd, comm_fd, wchan_fd, stat_fd;		/* per-process stat monitoring /proc/$pid/{wchan,stat} file handles */
+	int	cmdline_fd, wchan_fd, stat_fd;			/* per-process stat monitoring /proc/$pid/{cmdline,wchan,stat} file handles, comm comes from stat */
+	size_t	stat_size;					/* learned length of stat for sizing its reads, cmdline and wchan use their arrays' lengths */
 
 	char	changed[BITNSLOTS(VMON_PROC_STAT_NR)];		/* bitmap for indicating changed fields */
 
@@ -121,6 +135,7 @@ typedef enum _vmon_proc_vm_sym_t {
 
 typedef struct _vmon_proc_vm_t {
 	int	statm_fd;					/* per-process vm monitoring /proc/$pid/statm file handle */
+	size_t	statm_size;					/* learned length of statm, for sizing its reads */
 
 	char	changed[BITNSLOTS(VMON_PROC_VM_NR)];		/* bitmap for indicating changed fields */
 
@@ -138,6 +153,7 @@ typedef enum _vmon_proc_io_sym_t {
 
 typedef struct _vmon_proc_io_t {
 	int	io_fd;						/* per-process io monitoring /proc/$pid/io file handle */
+	size_t	io_size;					/* learned length of io, for sizing its reads */
 
 	char	changed[BITNSLOTS(VMON_PROC_IO_NR)];		/* bitmap for indicating changed fields */
 
@@ -146,9 +162,72 @@ typedef struct _vmon_proc_io_t {
 } vmon_proc_io_t;
 
 
+/* scheduler statistics of the task (for processes that's the main thread, like /proc/$pid/stat), needs CONFIG_SCHED_INFO */
+typedef enum _vmon_proc_schedstat_sym_t {
+#define VMON_ENUM_SYMBOLS
+#include "defs/proc_schedstat.def"
+	VMON_PROC_SCHEDSTAT_NR					/* append this symbol to the end so we have a count */
+} vmon_proc_schedstat_sym_t;
+
+typedef struct _vmon_proc_schedstat_t {
+	int	schedstat_fd;					/* per-process schedstat monitoring /proc/$pid/schedstat file handle */
+	size_t	schedstat_size;					/* learned length of schedstat, for sizing its reads */
+
+	char	changed[BITNSLOTS(VMON_PROC_SCHEDSTAT_NR)];	/* bitmap for indicating changed fields */
+
+#define VMON_DECLARE_MEMBERS
+#include "defs/proc_schedstat.def"
+} vmon_proc_schedstat_t;
+
+
+/* final totals of exiting processes and threads, from the taskstats exit notifications.
+ * Only processes whose tasks all exited while vmon was listening get complete totals.
+ * The listener gets registered by vmon_init() when its proc_wants include VMON_WANT_PROC_EXIT.
+ */
+typedef enum _vmon_proc_exit_sym_t {
+#define VMON_ENUM_SYMBOLS
+#include "defs/proc_exit.def"
+	VMON_PROC_EXIT_NR					/* append this symbol to the end so we have a count */
+} vmon_proc_exit_sym_t;
+
+typedef struct _vmon_proc_exit_t {
+	unsigned	tasks;					/* number of exited tasks summed into the totals */
+	unsigned	exited:1;				/* the process (or thread) has exited, the totals are final */
+	unsigned	reported:1;				/* exits were reported since the last sample, the changed bits are already current */
+
+	char	changed[BITNSLOTS(VMON_PROC_EXIT_NR)];		/* bitmap for indicating changed fields */
+
+#define VMON_DECLARE_MEMBERS
+#include "defs/proc_exit.def"
+} vmon_proc_exit_t;
+
+
+/* perf_event counters of the task, read with a single read() per group.  For processes that's their main thread, the counters
+ * aren't inherited, so a followed main thread doesn't open another set of its own: its store stays NULL, its process's is the one.
+ * The software counters form one group, the hardware counters another when available so their multiplexing can't stop the former.
+ * Unprivileged callers need perf_event_paranoid <= 1 (or CAP_PERFMON), the counters can't be opened at all otherwise and are
+ * simply absent.  They're also left absent for tasks whose counters would take the pinned handles over half of vmon_t.fd_budget.
+ */
+typedef enum _vmon_proc_perf_sym_t {
+#define VMON_ENUM_SYMBOLS
+#include "defs/proc_perf.def"
+	VMON_PROC_PERF_NR					/* append this symbol to the end so we have a count */
+} vmon_proc_perf_sym_t;
+
+typedef struct _vmon_proc_perf_t {
+	int	fds[VMON_PROC_PERF_NR];				/* per-counter perf_event handles, -1 for the unavailable */
+
+	char	changed[BITNSLOTS(VMON_PROC_PERF_NR)];		/* bitmap for indicating changed fields */
+
+#define VMON_DECLARE_MEMBERS
+#include "defs/proc_perf.def"
+} vmon_proc_perf_t;
+
+
 /* follow children want context */
 typedef struct _vmon_proc_follow_children_t {
 	int	children_fd;					/* per-process children following /proc/$pid/task/$pid/children file handle */
+	size_t	children_size;					/* learned length of children, for sizing its reads */
 } vmon_proc_follow_children_t;
 
 
@@ -193,6 +272,29 @@ typedef struct _vmon_fobject_t {
 	void			*foo;				/* hook for caller's data, if needed (expected to be used together with fobject_[cd]tor_cb) */
 } vmon_fobject_t;
 
+/* interned string, the comm/cmdline/exe/wchan values identical across processes share one of these */
+typedef struct _vmon_str_t {
+	list_head_t		bucket;				/* strs hash table bucket this string belongs to */
+	uint32_t		hash;				/* hash of the contents */
+	int			refcnt;				/* number of vmon_char_array_t's using the contents */
+	size_t			len;				/* length of the contents */
+	int			argc;				/* argv built from the contents on their first use as a cmdline */
+	char			**argv;
+	char			str[];				/* the contents, '\0' terminated */
+} vmon_str_t;
+
+typedef struct _vmon_strs_t {
+	list_head_t		*buckets;			/* chained hash table of the interned strings keyed on their contents, allocated on first use */
+	int			bits;				/* log2 of the number of buckets */
+	int			nr;				/* number of strings in the table */
+} vmon_strs_t;
+
+typedef struct _vmon_fobjects_t {
+	list_head_t		*buckets;			/* chained hash table of fobjects of a given type keyed on inum, allocated on first use */
+	int			bits;				/* log2 of the number of buckets */
+	int			nr;				/* number of fobjects in the table */
+} vmon_fobjects_t;
+
 typedef struct _vmon_proc_fd_t {
 	list_head_t		fds;				/* per-process files list node */
 	int			generation;			/* generation number, for convenient detection of closed files */
@@ -207,7 +309,8 @@ typedef struct _vmon_proc_fd_t {
 typedef struct _vmon_proc_files_t {
 	int			refcnt;				/* reference count for dealing with sharing of open files (like threads...) */
 	DIR			*fd_dir;			/* per-process files /proc/$pid/fd handle */
-	list_head_t		fds;				/* per-process files linked list head */
+	list_head_t		fds;				/* per-process files linked list head, kept sorted by fdnum */
+	int			revalidate_countdown;		/* samples remaining before every fd is readlinked again, see proc_sample_files() */
 } vmon_proc_files_t;
 
 
@@ -224,38 +327,68 @@ typedef struct _vmon_proc_callback_t {
 } vmon_proc_callback_t;
 
 typedef struct _vmon_proc_t {
-	list_head_t		bucket;				/* processes hash table bucket this process belongs to */
-
-	list_head_t		children;			/* head of the children of this process, empty when no children */
-	list_head_t		siblings;			/* node in siblings list */
-	list_head_t		threads;			/* head or node for the threads list, empty when process has no threads */
-
-	struct _vmon_proc_t	*parent;			/* reference to the parent */
-
-	int			array_hint_pos;			/* hint for the process's position in the array (when array maintenance has been requested) */
+	/* The members are grouped into cache lines by how often sampling touches them, the slab places these objects on a line:
+	 * 1. the flags, wants and the per-sample bookkeeping, touched for every process every sample, followed by the first stores
+	 * 2. the rest of the stores and the callbacks
+	 * 3. the hierarchy and the caller's hook, walked by the children/threads following and the recursive samplers
+	 * 4. whatever only VMON_FLAG_ADAPTIVE, VMON_FLAG_PIDFD and the (un)monitoring bookkeeping touch, kept out of the first three
+	 */
+	unsigned		children_changed:1;		/* gets set when any of my immediate children have had is_new or is_stale set in the last sample */
+	unsigned		threads_changed:1;		/* gets set when any of my threads have had is_new or is_stale set in the last sample */
+	unsigned		is_new:1;			/* process is new in the most recent sample, automatically cleared on subsequent sample */
+	unsigned		is_stale:1;			/* process became stale in the most recent sample, automatically cleared on subsequent sample (process will be discarded) */
+	unsigned		is_thread:1;			/* process is a thread belonging to parent */
+	unsigned		is_threaded:1;			/* gets set when any of my immediate children are/have been threads */
+	unsigned		reload:1;			/* re-read the exec-sensitive details next sample (exec reported by the proc connector, or vmon_proc_reload()) */
+	unsigned		exited:1;			/* process exit has been reported by the proc connector (VMON_FLAG_PROC_EVENTS) or its pidfd (VMON_FLAG_PIDFD), becomes is_stale in the next follow_children */
+	unsigned		idle_skip:1;			/* the stat/vm/io/perf/schedstat wants are being skipped this sample (VMON_FLAG_ADAPTIVE) */
+	unsigned		fd_busy:1;			/* the /proc handles have been restored for the samplers, they mustn't be evicted until sampled */
+	unsigned		fds_nr:4;			/* number of evictable /proc handles open in the stores, as of the last count (at most PROC_HANDLES_MAX) */
 
+	vmon_proc_wants_t	wants;				/* wants @ this node */
+	vmon_proc_wants_t	activity;			/* bits updated when there's activity on the respective wants (stores have changes) */
 	int			pid;				/* the PID of the process being monitored */
-
 	int			generation;			/* generation number, for convenient detection of exited processes */
-	int			refcnt;				/* reference count on this node */
-	vmon_proc_wants_t	wants;				/* wants @ this node */
+	int			sampled_generation;		/* generation the stat/vm/io/perf/schedstat wants were last sampled in, lags vmon_t.generation while skipped */
+	struct _vmon_proc_t	*parent;			/* reference to the parent */
+	list_head_t		fd_lru;				/* node on vmon_t.fd_lru while holding open /proc handles, empty otherwise */
 
-	vmon_proc_wants_t	activity;			/* bits updated when there's activity on the respective wants (stores have changes) */
 	void			*stores[VMON_STORE_PROC_NR];	/* pointers to the per-want per-monitored-process storage space */
 
 								/* callbacks invoked after sampling wants at and below this node */
 	list_head_t		sample_callbacks;		/* list of callbacks to invoke sample_cb on behalf of (and supply as parameteres to) */
+
+	list_head_t		children;			/* head of the children of this process, empty when no children */
+	list_head_t		siblings;			/* node in siblings list */
 	void			*foo;				/* another per-process hook for whatever per-process uses the caller may have, but not managed by the api */
+	list_head_t		threads;			/* head or node for the threads list, empty when process has no threads */
 
-	unsigned		children_changed:1;		/* gets set when any of my immediate children have had is_new or is_stale set in the last sample */
-	unsigned		threads_changed:1;		/* gets set when any of my threads have had is_new or is_stale set in the last sample */
-	unsigned		is_new:1;			/* process is new in the most recent sample, automatically cleared on subsequent sample */
-	unsigned		is_stale:1;			/* process became stale in the most recent sample, automatically cleared on subsequent sample (process will be discarded) */
-	unsigned		is_thread:1;			/* process is a thread belonging to parent */
-	unsigned		is_threaded:1;			/* gets set when any of my immediate children are/have been threads */
+	int			idle_countdown;			/* samples left to skip in the current interval */
+	int			idle_interval;			/* samples skipped between samplings while idle, doubles up to VMON_IDLE_INTERVAL_MAX, 0 when active */
+	int			pidfd;				/* pidfd of the process, -1 for threads and unless VMON_FLAG_PIDFD was requested */
+	int			refcnt;				/* reference count on this node */
+	int			array_pos;			/* the process's position in the array, -1 when it has none (when array maintenance has been requested) */
 } vmon_proc_t;
 
 
+/* slab allocator size class, the per-process objects are allocated from these */
+typedef struct _vmon_slab_t {
+	void			*free;				/* free list of recycled objects */
+	void			*chunks;			/* list of chunks objects are carved from, the first is being carved */
+	size_t			chunk_used;			/* bytes of the first chunk carved so far */
+	unsigned		in_use_nr;			/* objects currently allocated */
+	unsigned		free_nr;			/* objects on the free list */
+	unsigned		chunks_nr;			/* chunks allocated from the heap */
+} vmon_slab_t;
+
+
+/* processes hash table slot, the key is kept inline so probing doesn't have to touch the processes */
+typedef struct _vmon_htab_slot_t {
+	uint32_t		key;				/* (pid << 1) | is_thread */
+	vmon_proc_t		*proc;				/* NULL when the slot is empty */
+} vmon_htab_slot_t;
+
+
 typedef struct _vmon_t {
 	DIR			*proc_dir;			/* /proc is opened @ vmon_init() */
 
@@ -264,17 +397,36 @@ typedef struct _vmon_t {
 	vmon_proc_t		**array;			/* array of processes being monitored (flat) */
 	int			array_allocated_nr;		/* number of entries in the table */
 	int			array_active_nr;		/* number of processes present in the table (including stale) */
-	int			array_hint_free;		/* hint for a free element in the list */
+	int			*array_free;			/* stack of the free indices in the table, sized to array_allocated_nr */
+	int			array_free_nr;			/* number of indices on the array_free stack */
 
-	list_head_t		htab[VMON_HTAB_SIZE];		/* hash table for quickly finding processes being monitored */
+	vmon_htab_slot_t	*htab;				/* open-addressed hash table for quickly finding processes being monitored, see vmon_proc_lookup() */
+	int			htab_bits;			/* log2 of the number of slots in htab */
+	int			htab_nr;			/* number of occupied slots in htab */
 	list_head_t		processes;			/* top of the processes hierarchy */
 	list_head_t		orphans;			/* ephemeral list of processes orphaned this sample, orphans wind up becoming top-level processes */
 	unsigned		processes_changed:1;		/* flag set when the toplevel processes list changes */
 
-	list_head_t		fobjects;			/* XXX TODO: temporary single fobjects table, in the future this will be an array of type-indexed
-								 * fobject hash tables */
-	int			fobjects_nr;			/* XXX TODO: temporary simple counter of number of fobjects, this will change into something
-								 * more like we have for the proceses array */
+	vmon_slab_t		slabs[VMON_SLAB_CLASSES];	/* slab allocator size classes for the per-process objects */
+	unsigned		slab_heap_nr;			/* per-process objects too large for the slabs currently allocated from the heap */
+
+	struct _vmon_pool_t	*pool;				/* private worker pool, NULL unless VMON_FLAG_PARALLEL was requested with VMON_FLAG_2PASS */
+	struct _vmon_uring_t	*uring;				/* private io_uring state, NULL unless VMON_FLAG_IO_URING was requested and available */
+	struct _vmon_ppids_t	*ppids;				/* private /proc scan state, NULL unless VMON_FLAG_PPID_HIERARCHY was requested */
+	struct _vmon_order_t	*order;				/* private flattened hierarchy, NULL unless VMON_FLAG_2PASS was requested */
+
+	int			proc_events_fd;			/* netlink proc connector socket, -1 unless VMON_FLAG_PROC_EVENTS was requested and permitted */
+	unsigned		proc_events_rescan:1;		/* proc connector events can't be trusted this sample (overflow, reparenting), read the children files */
+	unsigned		proc_events_rescan_next:1;	/* same as proc_events_rescan but deferred to the next sample */
+	int			pidfds_fd;			/* epoll instance watching the pidfds, readable when a monitored process has exited since the last sample,
+								 * -1 unless VMON_FLAG_PIDFD was requested and available.  Callers may add it to their poll set. */
+	int			taskstats_fd;			/* generic netlink socket registered for the taskstats exit notifications of every cpu,
+								 * -1 unless VMON_WANT_PROC_EXIT was requested and permitted */
+	int			taskstats_family;		/* generic netlink family id of taskstats */
+
+	vmon_fobjects_t		fobjects[VMON_FOBJECT_TYPE_NR];	/* type-indexed fobject hash tables, see fobject_lookup_hinted() */
+	int			fobjects_nr;			/* total number of fobjects across all the types */
+	vmon_strs_t		strs;				/* interned strings table, see str_intern() */
 	vmon_flags_t		flags;				/* instance flags */
 	vmon_sys_wants_t	sys_wants;			/* system-wide wants mask */
 	vmon_proc_wants_t	proc_wants;			/* inherited per-process wants mask */
@@ -290,10 +442,22 @@ typedef struct _vmon_t {
 	void			(*sample_cb)(struct _vmon_t *, void *);	/* callback invoked after executing the selected sys wants (once per vmon_sample() call)) */
 	void			*sample_cb_arg;			/* user pointer for sample_cb */
 
-	char			buf[8192];			/* scratch buffer for private use XXX: it may make sense to dynamically size these... */
-	char			buf_bis[8192];			/* secondary scratch buffer for private use */
+	char			*buf;				/* scratch buffer for private use, grown as needed to fit the largest file read in one go */
+	size_t			buf_size;			/* allocated size of buf */
+	int			*scan_pids;			/* scratch array of the pids found by the last directory scan or children read, in ascending order */
+	int			scan_pids_size;			/* allocated number of scan_pids */
+	vmon_proc_t		**scan_procs;			/* scratch array of the children being reconciled by proc_follow_children(), in ascending pid order */
+	int			scan_procs_size;		/* allocated number of scan_procs */
 	int			generation;			/* generation counter for whatever might need it, increments with vmon_sample() calls */
 
+	list_head_t		fd_lru;				/* processes holding evictable /proc handles, least recently used first */
+	int			fd_budget;			/* limit on the /proc, pidfd and perf_event handles kept open, 0 for unlimited, defaults to half of
+								 * RLIMIT_NOFILE and may be changed by the caller after vmon_init() */
+	int			fds_nr;				/* number of evictable /proc handles open, as last counted */
+	int			pinned_fds_nr;			/* number of pidfds and perf_event handles open, counted against fd_budget but never evicted */
+	unsigned long		fd_cache_hits;			/* handles found open when needed */
+	unsigned long		fd_cache_misses;		/* handles which had to be reopened after eviction */
+
 								/* callbacks we'll invoke in response to processes becoming instantiated and destroyed, when set */
 	void			(*proc_ctor_cb)(struct _vmon_t *, vmon_proc_t *);
 	void			(*proc_dtor_cb)(struct _vmon_t *, vmon_proc_t *);
@@ -307,6 +471,8 @@ typedef struct _vmon_t {
 int vmon_init(vmon_t *, vmon_flags_t, vmon_sys_wants_t, vmon_proc_wants_t);
 void vmon_destroy(vmon_t *);
 vmon_proc_t * vmon_proc_monitor(vmon_t *, int, vmon_proc_wants_t, void (*)(vmon_t *, void *, vmon_proc_t *, void *), void *);
+vmon_proc_t * vmon_proc_lookup(vmon_t *, int, int);
+void vmon_proc_reload(vmon_t *, vmon_proc_t *);
 void vmon_proc_unmonitor(vmon_t *, vmon_proc_t *, void (*)(vmon_t *, void *, vmon_proc_t *, void *), void *);
 int vmon_sample(vmon_t *);
 void vmon_dump_procs(vmon_t *vmon, FILE *out);
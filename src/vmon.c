@@ -50,6 +50,9 @@ typedef struct vmon_t {
 	int		dump_procs;
 	int		mem_locked;
 	int		reaper;
+	int		adaptive;
+	int		perf;
+	int		schedstat;
 	time_t		start_time;
 	int		snapshots_interval;
 	int		snapshot;
@@ -58,6 +61,7 @@ typedef struct vmon_t {
 	int		headless;
 	int		hertz;
 	char		*output_dir;
+	char		*accounting;
 	char		*name;
 	char		*wip_name;
 	unsigned	n_snapshots;
@@ -190,6 +194,8 @@ static void print_help(void)
 		" Flag              Description\n"
 		"-------------------------------------------------------------------------------\n"
 		" --                Sentinel, subsequent arguments form command to execute\n"
+		" -a  --adaptive    Sample idle processes progressively less often\n"
+		" -A  --accounting  Append a CSV record of every exited process to file\n"
 		" -f  --fullscreen  Fullscreen window (X only; no effect with --headless) \n"
 		" -d  --headless    Headless mode; no X, only snapshots (default on no-X builds)\n"
 		" -h  --help        Show this help\n"
@@ -200,6 +206,9 @@ static void print_help(void)
 		" -N  --now-names   Use current time in filenames instead of start time\n"
 		" -o  --output-dir  Directory to store saved output to (\".\" if unspecified)\n"
 		" -p  --pid         PID of the top-level process to monitor (1 if unspecified)\n"
+		" -P  --perf        Count context switches and migrations w/perf events\n"
+		"                   (needs perf_event_paranoid <= 1 or CAP_PERFMON; see perf_event_open(2))\n"
+		" -Q  --runqueue    Chart the share of time each task spent waiting on a runqueue\n"
 		" -i  --snapshots   Save a PNG snapshot every N seconds (SIG{TERM,USR1} also snapshots)\n"
 		" -s  --snapshot    Save a PNG snapshot upon receiving SIG{CHLD,TERM,USR1}\n"
 		" -w  --wip-name    Name to use for work-in-progress snapshot filename\n"
@@ -439,6 +448,11 @@ static int vmon_handle_argv(vmon_t *vmon, int argc, const char * const *argv)
 			if (!parse_flag_str(argv, end, argv + 1, 1, &vmon->output_dir))
 				return 0;
 
+			last = ++argv;
+		} else if (is_flag(*argv, "-A", "--accounting")) {
+			if (!parse_flag_str(argv, end, argv + 1, 1, &vmon->accounting))
+				return 0;
+
 			last = ++argv;
 		} else if (is_flag(*argv, "-n", "--name")) {
 			if (!parse_flag_str(argv, end, argv + 1, 1, &vmon->name))
@@ -500,6 +514,15 @@ static int vmon_handle_argv(vmon_t *vmon, int argc, const char * const *argv)
 		} else if (is_flag(*argv, "-L", "--mem-locked")) {
 			vmon->mem_locked = 1;
 			last = argv;
+		} else if (is_flag(*argv, "-a", "--adaptive")) {
+			vmon->adaptive = 1;
+			last = argv;
+		} else if (is_flag(*argv, "-P", "--perf")) {
+			vmon->perf = 1;
+			last = argv;
+		} else if (is_flag(*argv, "-Q", "--runqueue")) {
+			vmon->schedstat = 1;
+			last = argv;
 		} else if (is_flag(*argv, "-R", "--reaper")) {
 			vmon->reaper = 1;
 			last = argv;
@@ -637,12 +660,21 @@ static vmon_t * vmon_startup(int argc, const char * const *argv)
 		goto _err_free;
 	}
 
-	vmon->charts = vwm_charts_create(vmon->vcr_backend, VWM_CHARTS_FLAG_DEFER_MAINTENANCE);
+	vmon->charts = vwm_charts_create(vmon->vcr_backend, VWM_CHARTS_FLAG_DEFER_MAINTENANCE | (vmon->adaptive ? VWM_CHARTS_FLAG_ADAPTIVE : 0) | (vmon->perf ? VWM_CHARTS_FLAG_PERF : 0) | (vmon->schedstat ? VWM_CHARTS_FLAG_SCHEDSTAT : 0));
 	if (!vmon->charts) {
 		VWM_ERROR("unable to create charts instance");
 		goto _err_vcr;
 	}
 
+	if (vmon->accounting) {
+		int	r;
+
+		if ((r = vwm_charts_accounting_open(vmon->charts, vmon->accounting)) < 0) {
+			VWM_ERROR("unable to open accounting file \"%s\": %s", vmon->accounting, strerror(-r));
+			goto _err_vcr;
+		}
+	}
+
 	if (vmon->hertz)
 		vwm_charts_rate_set(vmon->charts, vmon->hertz);
 
@@ -925,6 +957,9 @@ int main(int argc, const char * const *argv)
 			}
 		}
 
+		/* accounting records accumulate while sampling, write them out before sleeping */
+		vwm_charts_accounting_flush(vmon->charts);
+
 		if (vcr_backend_poll(vmon->vcr_backend, delay_us) > 0)
 			vmon_process_event(vmon);
 